@@ -29,15 +29,70 @@ Summary:
 	
 	5. The card "browse" function will (re)"present" all the activated cards (again) to the controller
 	
+	6. Bulk sync with the controller on the sync child (CARD_SYNC_CHILD, S_CUSTOM):
+	- controller sends V_VAR1 = generation G * 65536 + version N: node sends the records changed since N as V_VAR2
+	  frames (2 records of 12 bytes: index(2) cardID(8) type(1) rule(1), little endian), followed by V_VAR1 =
+	  current generation * 65536 + version. The generation changes when the database starts over (init,
+	  renumbering, repair): for another G all records are sent, also the empty ones
+	- controller sends V_VAR2 frames in the same format: node imports them (master card is protected, master
+	  records are skipped) and answers with V_VAR1 = generation * 65536 + new version
+	- controller sends V_VAR3: node purges the deleted cards (compact) and answers with V_VAR1 = generation * 65536 +
+	  new version
+	- controller sends V_VAR4 = rule(1) days(1) hours(4) expiry(2): sets access rule 1..7
+	- controller sends V_VAR5 = index(2) rule(1): sets the access rule of a card
+	- controller sends V_CUSTOM = index(2) pin(4) digits(1): sets the PIN of a card (digits 0 = no PIN), only the
+	  salted hash is stored
+	
+	7. Cards with an access rule only open the door on the allowed weekdays/ hours until the expiry day (time from
+	the controller, requested every hour). Outside the schedule the display shows "Errt". Without time from the
+	controller only the master card and cards without rule (rule 0) open the door.
+	
+	8. Card + PIN: a card with a PIN only opens the door after the PIN is entered on the keypad of the reader
+	(display "PIn", PIN_DIGITS digits or ENTER (*), ESC (#) cancels). A wrong PIN shows "ErrP".
+	
+	9. Wiegand signal quality on the Wiegand child (WIEGAND_CHILD, S_CUSTOM), to diagnose cabling:
+	- controller sends V_VAR1: node answers with V_VAR1 = edges D0, D1 (2x2) gap histogram (8x2, < 128us << n)
+	  and V_VAR2 = frames(2) rejects by length / 8 (8x2) parity failures(2) queue overflows(2), little endian
+	- controller sends V_VAR3: node clears the counters
+	
+	10. State machine trace on the state child (STATE_CHILD, S_CUSTOM), to find out what a misbehaving door did:
+	- controller sends V_VAR1: node answers with V_VAR1 frames of the last transitions, oldest first (4 per frame:
+	  from(1) to(1) millis(4)), V_VAR2 frames with the states (3 per frame: id(1) entries(2) dwell ms(4)) and
+	  V_VAR3 = current state(1) millis(4), little endian. State ids: 1 idle, 2 active, 3 mode, 4 delay,
+	  5 unlock, 6 include, 7 delete, 8 confirm, 9 browse, 10 pin. The dwell of a superstate (active, mode)
+	  includes the time in its substates
+	- controller sends V_VAR4: node clears the trace and the state statistics
+	
 	
 Remarks:
 	Fixed node-id
-	State machine based on FiniteStateMachine library
+	Card ids: 26 and 34 bit codes are the card id (as before), longer formats (35, 37, 48 bit) get their bit length
+	in bits 48..55 of the 64 bit card id, so cards of different formats never share an id. Shown as bits:hex
+	State machine based on FiniteStateMachine library, cards are dispatched as events through a transition table
+	The states after a card (delay, unlock and the master card modes) share the return to idle in superstate "active"
 	
 Change log:
 20160920 - created
 20161020 - updated to include MySensors V_TEXT status log. Log should be kept by controller
 20161023 - clean & comment code
+20261016 - bulk database sync with the controller
+20261016 - database generation with the sync version, full export after a reset or repair
+20261016 - access rules (schedule) per card
+20261016 - database is validated at boot, no initDB on every start
+20261016 - optional EEPROM traffic statistics of the card database (CARDDB_STATS)
+20261016 - Wiegand 35, 37 and 48 bit cards (codes longer than 32 bit are folded to the 32 bit card id)
+20261016 - 64 bit card ids, formats beyond 34 bit tagged with their length instead of folded
+20261016 - keypad PIN entry, card + PIN mode
+20261016 - Wiegand signal quality counters
+20261016 - card handling of the states in a transition table
+20261016 - state timeouts in the state machine, CPU idles between interrupts
+20261016 - state machine transition trace and dwell times on the state child
+20261016 - superstates for the shared timeout and the master card modes
+20261016 - LED/ beeper feedback patterns (denied, included, database full)
+20261016 - led and buzzer updated as a group (port written only on change)
+20261016 - led and buzzer clocked from a timer interrupt (FEEDBACK_TIMER)
+20261016 - shared wrap safe timer wheel for the sketch, state machine and LedFlash
+20261016 - status led fades in on unlock and breathes in the master card modes
 */
 #define MY_NODE_ID 10
 #define NODE_TXT "Cardreader 10"					// Text to add to sensor name
@@ -59,10 +114,14 @@ Change log:
 #include <SPI.h>
 #include <MySensors.h>
 
+#ifdef __AVR__
+#include <avr/sleep.h>
+#endif
 #include "CardDB.h"									// AWI: local lib to store cards
 #include "Wiegand.h"								// Wiegand protocol lib https://github.com/monkeyboard/Wiegand-Protocol-Library-for-Arduino
 #include "FiniteStateMachine.h"						// FiniteStateMachine https://github.com/gusgonnet/particle-fsm/tree/master/firmware
 #include "LedFlash.h"								// AWI: non blocking class for flexible LED/ buzzer 
+#include "TimerWheel.h"								// AWI: shared timers (sketch, state machine)
 #include "SevenSegmentTM1637.h"						// 4 digit 7 segment display https://github.com/bremme/arduino-tm1637
 
 // helpers
@@ -74,10 +133,12 @@ Change log:
 	#define Sprint(...)
 	#define Sprintln(...)
 #endif
+//#define CARDDB_STATS												// print EEPROM reads/ writes of the card database per swipe
+#define FEEDBACK_TIMER												// led and buzzer clocked from a timer interrupt (not from the loop)
 //** door lock 
 const byte DOORLOCK = 5 ;
 //** LedFlash lib used for the Buzzer and Led on the cardreader */
-const byte LED_PIN = 6;												// status led
+const byte LED_PIN = 6;												// status led (PWM pin for fade/ breathe)
 const byte BEEP_PIN = 7 ; 											// beep
 //** LED Display connections (library serial protocol)
 const byte PIN_CLK = A4;   											// define CLK pin (any digital pin)
@@ -85,56 +146,122 @@ const byte PIN_DIO = A5;   											// define DIO pin (any digital pin)
 //** MySensors children
 const byte CARD_CHILD = 0 ; 										// MySensors master card child (rest of cards are dynamic)
 const byte CARD_ID_CHILD = 1 ; 										// MySensors card id/ log sensor 
+const byte CARD_SYNC_CHILD = 100 ; 									// MySensors database sync (outside the card index range)
+const byte WIEGAND_CHILD = 101 ; 									// MySensors Wiegand signal quality
+const byte STATE_CHILD = 102 ; 										// MySensors state machine trace
 
 const unsigned long MASTERCARD = xxxxxxx ;							// Hardcoded MASTERCARD, insert you master Rfid code here
+const byte PIN_DIGITS = 4 ;											// PIN length (0 = PIN is closed with ENTER)
 
 // Instantiate library objects
 SevenSegmentTM1637    display(PIN_CLK, PIN_DIO);					// LED display
 LedFlash statusLed(LED_PIN,true, 50, 400);							// status led (active on, flash on 50ms/ period 400ms )
 LedFlash statusBeep(BEEP_PIN,true, 2, 400);							// buzzer (active on, flash on 2ms/ period 400ms )
-CardDB cardDB ; 													// EEPROM database routines
+LedFlashGroup feedback ;											// updates led and buzzer together
+#ifdef CARDDB_STATS
+EEPROMStorage cardEEPROM(EEPROM_Start) ;							// card database storage (internal EEPROM)
+CountingStorage<EEPROMStorage> cardStore(cardEEPROM) ;				// counts the EEPROM traffic
+CardDBT<CountingStorage<EEPROMStorage>, MAXCARDS, JOURNALSIZE> cardDB(cardStore) ; // EEPROM database routines
+#else
+EEPROMStorage cardStore(EEPROM_Start) ;								// card database storage (internal EEPROM)
+CardDB cardDB(cardStore) ; 											// EEPROM database routines
+#endif
 WIEGAND wg;															// instantiate Wiegand
+WiegandPin pinEntry(PIN_DIGITS, 5000UL) ;							// keypad PIN, max 5s between keys
 
 // state machine definitions (&routines need to be defined)
-FState idleState( &idleEnter, &idleUpdate, NULL );  				// Idle state (doe not need exit routine)
-FState delayState( &delayEnter, &delayUpdate, &delayExit);	  		// delay after invalid card
-FState unlockState( &unlockEnter, &unlockUpdate, &unlockExit);  	// Unlocks after valid card
-FState includeState( &includeEnter, &includeUpdate, &includeExit);  // waiting for inclusion of new card
-FState deleteState( &deleteEnter, &deleteUpdate, &deleteExit);  	// deletion of card
-FState confirmState( &confirmEnter, &confirmUpdate, &confirmExit);  // confirmation of deletion
+const unsigned long idleTime = 2000UL ;								// delay to return to idle
+const unsigned long pinTime = 15000UL ;								// max time for the PIN entry
+FState idleState( &idleEnter, NULL, NULL );  						// Idle state (cards are handled by the transition table)
+FState activeState( NULL, NULL, NULL, idleTime, idleState);			// superstate: back to idle after idleTime in a substate
+FState modeState( activeState, &modeEnter, NULL, &modeExit);		// superstate of the master card modes (led/ beep flash)
+FState delayState( activeState, &delayEnter, NULL, &delayExit);		// delay after invalid card
+FState unlockState( activeState, &unlockEnter, NULL, &unlockExit);	// Unlocks after valid card
+FState includeState( modeState, &includeEnter, NULL, &includeExit);	// waiting for inclusion of new card
+FState deleteState( modeState, &deleteEnter, NULL, &deleteExit);	// deletion of card
+FState confirmState( modeState, &confirmEnter, NULL, &confirmExit);	// confirmation of deletion
 FState browseState( &browseEnter, &browseUpdate, &browseExit);  	// browse cards
+FState pinState( &pinEnter, &pinUpdate, &pinExit, pinTime, idleState);	// PIN entry after a card with PIN
 FiniteStateMachine stateMachine(idleState) ; 						//initialize state machine, start in state: noop
-
-const unsigned long idleTime = 2000UL ;								// delay to return to idle
-unsigned long browseTimer = millis() ;								// timer for browsing
+FState * const states[] = {&idleState, &activeState, &modeState, &delayState, &unlockState, &includeState, &deleteState, &confirmState, &browseState, &pinState} ; // for the statistics (all states, in id order)
+
+// card events (cardEvent) and the transitions they cause, first matching row wins
+enum cardEvents_t : byte { evNone, evMaster, evCard, evDeleted, evUnknown } ;
+const FTransition cardTable[] PROGMEM = {
+//	  state			event		guard		action			next
+	{&idleState,	evMaster,	pinNeeded,	selectCard,		&pinState},
+	{&idleState,	evMaster,	NULL,		selectCard,		&unlockState},
+	{&idleState,	evCard,		pinNeeded,	selectCard,		&pinState},
+	{&idleState,	evCard,		accessOk,	selectCard,		&unlockState},
+	{&idleState,	evCard,		NULL,		refuseSchedule,	&delayState},
+	{&idleState,	evDeleted,	NULL,		refuseDeleted,	&delayState},
+	{&idleState,	evUnknown,	NULL,		refuseUnknown,	&delayState},
+	{&unlockState,	evMaster,	NULL,		NULL,			&includeState},	// master card, prepare for inclusion
+	{&includeState,	evMaster,	NULL,		NULL,			&deleteState},
+	{&includeState,	evCard,		NULL,		reincludeCard,	&delayState},	// delay only to extend display time
+	{&includeState,	evDeleted,	NULL,		reincludeCard,	&delayState},
+	{&includeState,	evUnknown,	NULL,		includeCard,	&delayState},
+	{&deleteState,	evMaster,	NULL,		NULL,			&browseState},
+	{&deleteState,	evCard,		NULL,		selectDelete,	&confirmState},
+	{&deleteState,	evDeleted,	NULL,		selectDelete,	&confirmState},
+	{&deleteState,	evUnknown,	NULL,		selectDelete,	&confirmState},
+	{&confirmState,	evMaster,	NULL,		deleteSelected,	&idleState},
+	{&browseState,	evMaster,	NULL,		NULL,			&idleState},
+} ;
+
+WheelTimer browseTimer ;											// timer for browsing
 const unsigned long browseTime = 800UL ;							// detay for browsing
 
-unsigned long heartbeat = 60000UL ;									// heartbeat every hour
-unsigned long lastHeartbeat = millis() ; 
+WheelTimer debugTimer ;												// "once in a while" timer
 
-unsigned long lastUpdate = millis(); 								// timer value
+unsigned long controllerTime = 0 ;									// last time received from controller (0 = unknown)
+unsigned long timeSync = 0 ;										// millis() at controllerTime
+const unsigned long timeRequest = 3600000UL ;						// request time from controller every hour
+WheelTimer timeRequestTimer ;
 
 
-unsigned long lastCardID = 0 ;										// holds last card value for inclusion / deletion
+uint64_t cardCode = 0 ;												// card id of the new card (cardKey)
+uint64_t lastCardID = 0 ;											// holds last card value for inclusion / deletion
 int curCard = 0 ;													// Used as a browse pointer and temp store for deletion/ inclusion
+int cardIdx = 0 ;													// database index of the new card (cardEvent)
 bool newCard = false ;												// global to indicate new card is available
+bool newKey = false ;												// global to indicate a key press is available
+char keyCode = 0 ;													// key of the key press (0..9, WIEGAND_ENTER, WIEGAND_ESCAPE)
+
+bool syncActive = false ;											// database export to controller in progress
+uint16_t syncSince = 0 ;											// export records changed after this version
+uint16_t syncGeneration = 0 ;										// of this database generation (else all records)
+uint16_t syncIndex = 0 ;											// export position (card index)
 
 // MySensor messages
 MyMessage cardStatusMsg(0,V_STATUS);								// Each card id has its own "Switch", which is presented at inclusion
 MyMessage cardIdMsg(0,V_TEXT);										// Each card id has its own identifier, sent a text to controller 
+MyMessage cardSyncMsg(CARD_SYNC_CHILD,V_VAR2);						// database sync frame (packed records)
+MyMessage cardVersionMsg(CARD_SYNC_CHILD,V_VAR1);					// database version
+MyMessage wiegandMsg(WIEGAND_CHILD,V_VAR1);							// signal quality counters
+MyMessage stateMsg(STATE_CHILD,V_VAR1);								// state machine trace
 
 
 void setup() {
 	pinMode(DOORLOCK, OUTPUT) ;										// doorlock connection
+	feedback.add(statusLed) ;										// led and buzzer in one update
+	feedback.add(statusBeep) ;
+#ifdef FEEDBACK_TIMER
+	feedback.startTimer() ;											// patterns keep their timing during wait() and EEPROM writes
+#endif
 	display.begin();												// initializes the display
 	display.setBacklight(10);										// set the brightness to x %
 	display.print("INIT");											// display INIT on the display
 	wait(1000) ;
 	wg.begin();														// activate wiegand
-	lastUpdate = millis() ;
-	cardDB.initDB();												// ONLY in the first run to clear the EEPROM store (comment later)
-	cardDB.writeCardIdx(0, MASTERCARD);								// MASTER card (HARD CODED)
-	cardDB.setCardTypeIdx(0, CardDB::masterCard) ;					// write to 0 index in database
+	debugTimer.start(5000UL, 5000UL) ;
+	CardDB::dbStatus_t dbStatus = cardDB.begin();					// validate and load the card database (initialised if blank or corrupt)
+	Sprint("CardDB: ");
+	Sprintln(dbStatus==CardDB::dbValid?"valid":dbStatus==CardDB::dbRepaired?"repaired":"init") ;
+	if (cardDB.readCardIdIdx(0) != MASTERCARD || cardDB.readCardTypeIdx(0) != CardDB::masterCard){ // only after init or master change
+		cardDB.writeCardIdx(0, MASTERCARD);							// MASTER card (HARD CODED)
+		cardDB.setCardTypeIdx(0, CardDB::masterCard) ;				// write to 0 index in database
+	}
 	Sprint("EEPROM: ");
 	Sprintln(EEPROM_LOCAL_CONFIG_ADDRESS, HEX) ;
 }
@@ -143,27 +270,59 @@ void presentation(){
 	sendSketchInfo("AWI " NODE_TXT, "1.2");							// Sketch version to gateway and Controller
 	presentCard(CARD_CHILD) ;										// present the master card (index == 0)
 	present(CARD_ID_CHILD, S_INFO, "SwitchID " NODE_TXT);			// present the log child
+	present(CARD_SYNC_CHILD, S_CUSTOM, "CardDB " NODE_TXT);			// present the sync child
+	present(WIEGAND_CHILD, S_CUSTOM, "Wiegand " NODE_TXT);			// present the signal quality child
+	present(STATE_CHILD, S_CUSTOM, "State " NODE_TXT);				// present the state machine trace child
+	requestTime() ;													// time for the access rules
+	timeRequestTimer.start(timeRequest, timeRequest) ;
 }
 
 void loop() {
-    unsigned long now = millis();									// timer value for "once in a while" events
-    if (now-lastUpdate > 5000UL) {									// change after 5 seconds
+	timerWheel.update() ;											// timers of the sketch and state machine
+    if (debugTimer.expired()) {										// every 5 seconds
 		//cardDB.printDB() ;										// only for debug
-		lastUpdate = now;
+	}
+	if (timeRequestTimer.expired()){								// keep the clock in sync
+		requestTime() ;
 	}
 	newCard = wg.available() ;
+	newKey = newCard && wg.getWiegandType() <= 8 ;					// 4 and 8 bit frames are keypad keys
+	if(newKey){
+		newCard = false ;
+		keyCode = (char)wg.getCode() ;
+		Sprint("Wiegand key = ");
+		Sprintln(keyCode, HEX);
+	}
 	if(newCard){
-		Sprint("Wiegand HEX = ");
-		Sprint(wg.getCode(),HEX);
-		Sprint(", DECIMAL = ");
-		Sprint(wg.getCode());
+		cardCode = cardKey(wg.getCode(), wg.getWiegandType()) ;
+		char tmpBuf[16] ;
+		Sprint("Wiegand card = ");
+		Sprint(cardText(tmpBuf, cardCode));
 		Sprint(", Type W ");
 		Sprintln(wg.getWiegandType());
-		//sendLog(wg.getCode(), "presented");
+		//sendLog(cardCode, "presented");
 	}
 	stateMachine.update();											// check and update non blocking
-	statusLed.update() ;
-	statusBeep.update() ;
+	stateMachine.dispatch(cardEvent(), cardTable) ;					// new card through the transition table
+	cardDB.update() ;												// background journal compaction (if JOURNALSIZE)
+	if (syncActive){												// one sync frame per loop
+		syncUpdate() ;
+	}
+#ifdef CARDDB_STATS
+	if (cardStore.reads || cardStore.writes){						// EEPROM traffic of this loop (swipe, enroll, ...)
+		Serial.print("CardDB ") ; cardStore.print() ;
+		cardStore.reset() ;
+	}
+#endif
+#ifndef FEEDBACK_TIMER
+	feedback.update() ;												// led and buzzer
+#endif
+#ifdef __AVR__
+	if (stateMachine.timeToDeadline() && timerWheel.nextDeadline()){	// nothing due: idle until the next interrupt
+		set_sleep_mode(SLEEP_MODE_IDLE) ;							// (Wiegand edge/ frame timer, RS485, millis tick)
+		sleep_mode() ;
+	}
+#endif
 	}
 
 	
@@ -177,149 +336,50 @@ void idleEnter() {Sprintln(" idle enter") ;
 	statusBeep.off() ;
 	display.clear();													// emptdisplay
 }
-void idleUpdate(){
-	if (newCard){
-		curCard = cardDB.readCard(wg.getCode()) ;						
-		if(curCard != cardDB.maxCards){									// card found
-			if(cardDB.readCardTypeIdx(curCard) == CardDB::masterCard || cardDB.readCardTypeIdx(curCard) == CardDB::idCard) { // only open if id or master card
-				stateMachine.transitionTo(unlockState);
-			} else if (cardDB.readCardTypeIdx(curCard) == CardDB::delCard){// card found but deleted
-				display.print("Errd");
-				sendLog(wg.getCode(), "Deleted Card");
-				stateMachine.transitionTo(delayState);
-			}
- 		} else {														// card not found
-			display.print("Err");
-			sendLog(wg.getCode(), "Unknown Card");
-			stateMachine.transitionTo(delayState);
-		}
-	}
-}
 
 //** DELAY state **//
 void delayEnter() {	Sprintln(" delay enter") ;
 }
-void delayUpdate() {
-	if (stateMachine.timeInCurrentState() > idleTime){
-		Sprintln(" to idle") ; stateMachine.transitionTo(idleState);
-	}
-}
 void delayExit(){Sprintln(" delay exit") ;}
 
 //** UNLOCK state **//
 void unlockEnter() {Sprintln(" unlock enter") ;
 	display.print(curCard);												// display Card index (curCard) on the display
 	Sprintln("Door unlocked");
-	sendLog(wg.getCode(), "Unlocked");
+	sendLog(cardCode, "Unlocked");
 	lockDoor(false) ; 													// Unlock the door
+	statusLed.fade(255, 300) ;											// led fades in while unlocked
 	send(cardStatusMsg.setSensor(curCard).set(1));						// send update for sensor (card) to show its usage.
 }
-void unlockUpdate() {
-	if (stateMachine.timeInCurrentState() > idleTime){
-		Sprintln(" to idle") ;
-		stateMachine.transitionTo(idleState);
-		}
-	if (newCard){														// new tag
-		if(cardDB.readCardType(wg.getCode()) == CardDB::masterCard){	// master card, prepare for inclusion
-			Sprintln(" to include") ;
-			stateMachine.transitionTo(includeState);
-		}
-	}
-}
 void unlockExit(){Sprintln(" unlock exit") ;
 	lockDoor(true) ; 													// Lock the door
 	Sprintln("Door locked");
 }
 
+//** MODE superstate (include, delete, confirm)
+void modeEnter() {Sprintln(" mode enter") ;
+	statusLed.breathe(1600) ;										// master card modes: breathing led
+	statusBeep.flash() ;
+}
+void modeExit() {Sprintln(" mode exit") ;}							// flash ends with a feedback pattern or in idle/ browse
+
 //** INCLUDE state
 void includeEnter() {
 	Sprintln(" include enter") ;
 	display.print("Incl");
-	statusLed.flash() ;
-	statusBeep.flash() ;
 };
-void includeUpdate(){
-	if (stateMachine.timeInCurrentState() > idleTime){
-		Sprintln(" to idle") ;
-		stateMachine.transitionTo(idleState);
-	}
-	if (newCard){														// new tag
-		curCard = cardDB.readCard(wg.getCode()) ;
-		if (curCard != cardDB.maxCards){								// known card
-			if(cardDB.readCardTypeIdx(curCard) == CardDB::masterCard){	//  master card, goto delete state
-				Sprintln(" to delete") ;
-				stateMachine.transitionTo(deleteState);
-			} else {													// known other card, so only change card type
-				cardDB.setCardTypeIdx(curCard, CardDB::idCard) ;					
-				display.clear(); display.print(curCard);
-				sendLog(wg.getCode(), "re-included");
-				presentCard(curCard); 									// present the new card as a switch and switch on
-				Sprintln(" to delay") ; stateMachine.transitionTo(delayState); // delay only to extend display time
-			}
-		} else {														// unknown card, so add in empty spot
-			curCard = cardDB.writeCard(wg.getCode()) ;
-			if(curCard == cardDB.maxCards){								//  if maxCards, database full
-				display.clear(); display.print("Full") ;
-				sendLog(wg.getCode(), "DB full");
-				Sprintln(" to delay") ; stateMachine.transitionTo(delayState); // delay only to extend display time
-			} else {													// include 
-				display.clear(); display.print(curCard);
-				sendLog(wg.getCode(), "included");
-				presentCard(curCard); 									// present the new card as a switch and switch on
-				Sprintln(" to delay") ; stateMachine.transitionTo(delayState); // delay only to extend display time
-			}
-		}
-	}
-}
-void includeExit(){
-	Sprintln(" include exit") ;
-	statusLed.off() ;
-	statusBeep.off() ;
-	}
+void includeExit(){Sprintln(" include exit") ;}
 
 //** DELETE state
 void deleteEnter() {
 	Sprintln(" delete enter") ;
 	display.print("Del");
-	statusLed.flash() ;
-	statusBeep.flash() ;
 };
-void deleteUpdate(){
-	if (stateMachine.timeInCurrentState() > idleTime){
-		Sprintln(" to idle") ; stateMachine.transitionTo(idleState);
-	}
-	if (newCard) {
-		if(cardDB.readCardType(wg.getCode()) == CardDB::masterCard){	//  master card, goto Browse
-			Sprintln(" to browse") ;
-			stateMachine.transitionTo(browseState);
-		}else {	
-			lastCardID = wg.getCode() ;									// store code for deletion
-			Sprintln(" to Confirm") ; stateMachine.transitionTo(confirmState);
-		}
-	}
-}
 void deleteExit() {	Sprintln(" delete exit") ;}
 
 //** CONFIRM state
 void confirmEnter() { Sprintln(" confirm enter") ;
 	display.print("Conf");
-	statusLed.flash() ;
-	statusBeep.flash() ;
-}
-void confirmUpdate(){
-	if (stateMachine.timeInCurrentState() > idleTime){
-		Sprintln(" to idle") ;
-		stateMachine.transitionTo(idleState);
-	}
-	if (newCard) {
-		if(cardDB.readCardType(wg.getCode()) == CardDB::masterCard){	//  master card means confirmed
-			Sprint("Delete Card: "); Sprintln(lastCardID) ;
-			cardDB.deleteCard(lastCardID);								// delete card (lib takes care of presence)
-			sendLog(wg.getCode(), "deleted");
-			send(cardStatusMsg.setSensor(lastCardID).set(0));			// switch controller status to "off"
-			Sprintln(" to idle") ; stateMachine.transitionTo(idleState);
-		}
-	}
 }
 void confirmExit() {Sprintln(" confirm exit") ;}
 
@@ -327,21 +387,14 @@ void confirmExit() {Sprintln(" confirm exit") ;}
 void browseEnter() {Sprintln(" browse enter") ;
 	display.print("Brws");
 	curCard = 0 ;
-	browseTimer = millis() ;
+	browseTimer.start(browseTime, browseTime) ;
 	statusLed.off() ;
 	statusBeep.off() ;
 
 }
 void browseUpdate(){
-	unsigned long now = millis() ;
-	if (newCard) {
-		if(cardDB.readCardType(wg.getCode()) == CardDB::masterCard){	//  master card, return to IDLE
-			Sprintln(" to idle") ; stateMachine.transitionTo(idleState);
-		}
-	}
-	if (now >= browseTimer + browseTime){
+	if (browseTimer.expired()){
 		Sprint(" browse id: ") ; Sprintln(curCard);
-		browseTimer = now ;
 		display.clear();
 		display.print(curCard);
 		display.setCursor(0,2) ;
@@ -355,12 +408,110 @@ void browseUpdate(){
 			display.print("dl");
 			presentCard(curCard);
 		} else if(cardDB.readCardTypeIdx(curCard)== CardDB::noCard){ display.print("no");}
-		if (++curCard > cardDB.maxCards){								// idle if end of database
+		if (++curCard >= cardDB.maxCards){								// idle if end of database
 			Sprintln(" to idle") ; stateMachine.transitionTo(idleState);
 		}
 	}
 }
-void browseExit(){Sprintln(" browse exit") ;}
+void browseExit(){Sprintln(" browse exit") ;
+	browseTimer.stop() ;
+}
+
+//** card events: guards and actions of the transition table **//
+// cardEvent: classifies the new card with one database lookup (cardIdx), evNone if no card
+byte cardEvent(){
+	if (!newCard) return evNone ;
+	cardIdx = cardDB.readCard(cardCode) ;
+	if (cardIdx == cardDB.maxCards) return evUnknown ;
+	switch (cardDB.readCardTypeIdx(cardIdx)){
+		case CardDB::masterCard: return evMaster ;
+		case CardDB::idCard: return evCard ;
+		case CardDB::delCard: return evDeleted ;
+		default: return evUnknown ;
+	}
+}
+bool accessOk(){ return cardDB.accessAllowed(cardIdx, localTime()) ; }	// within schedule
+bool pinNeeded(){ return accessOk() && cardDB.cardHasPinIdx(cardIdx) ; }	// card + PIN
+void selectCard(){ curCard = cardIdx ; }
+void refuseSchedule(){
+	display.print("Errt");
+	statusBeep.play(ledDenied) ;
+	sendLog(cardCode, "Schedule");
+}
+void refuseDeleted(){
+	display.print("Errd");
+	statusBeep.play(ledDenied) ;
+	sendLog(cardCode, "Deleted Card");
+}
+void refuseUnknown(){
+	display.print("Err");
+	statusBeep.play(ledDenied) ;
+	sendLog(cardCode, "Unknown Card");
+}
+void reincludeCard(){													// known other card, so only change card type
+	curCard = cardIdx ;
+	cardDB.setCardTypeIdx(curCard, CardDB::idCard) ;
+	display.clear(); display.print(curCard);
+	statusLed.play(ledDoubleBlink) ;
+	statusBeep.play(ledDoubleBlink) ;
+	sendLog(cardCode, "re-included");
+	presentCard(curCard); 												// present the new card as a switch and switch on
+}
+void includeCard(){														// unknown card, so add in empty spot
+	curCard = cardDB.writeCard(cardCode) ;
+	display.clear();
+	if(curCard == cardDB.maxCards){										//  if maxCards, database full
+		display.print("Full") ;
+		statusLed.play(ledDbFull) ;
+		statusBeep.play(ledDbFull) ;
+		sendLog(cardCode, "DB full");
+	} else {															// include 
+		display.print(curCard);
+		statusLed.play(ledDoubleBlink) ;
+		statusBeep.play(ledDoubleBlink) ;
+		sendLog(cardCode, "included");
+		presentCard(curCard); 											// present the new card as a switch and switch on
+	}
+}
+void selectDelete(){ lastCardID = cardCode ; }							// store code for deletion
+void deleteSelected(){													// master card means confirmed
+	char tmpBuf[16] ;
+	Sprint("Delete Card: "); Sprintln(cardText(tmpBuf, lastCardID)) ;
+	cardDB.deleteCard(lastCardID);										// delete card (lib takes care of presence)
+	sendLog(cardCode, "deleted");
+	send(cardStatusMsg.setSensor(lastCardID).set(0));					// switch controller status to "off"
+}
+
+//** PIN state **//
+void pinEnter() {Sprintln(" pin enter") ;
+	pinEntry.clear() ;
+	display.clear() ;
+	display.print("PIn");
+}
+void pinUpdate(){
+	WiegandPin::pinStatus_t pinStatus = pinEntry.update(millis()) ;
+	if (newKey){
+		pinStatus = pinEntry.key(keyCode, millis()) ;
+	}
+	if (pinStatus == WiegandPin::pinDigit){								// show the progress, not the digits
+		display.clear() ;
+		for (byte i=0 ; i < pinEntry.getDigits() && i < 4 ; i++) display.print("-") ;
+	} else if (pinStatus == WiegandPin::pinDone){
+		if (cardDB.checkPinIdx(curCard, pinEntry.getPin(), pinEntry.getDigits())){
+			stateMachine.transitionTo(unlockState);
+		} else {
+			display.clear() ; display.print("ErrP");
+			statusBeep.play(ledDenied) ;
+			sendLog(cardCode, "Wrong PIN");
+			stateMachine.transitionTo(delayState);
+		}
+	} else if (pinStatus == WiegandPin::pinCancel || pinStatus == WiegandPin::pinTimeout){
+		Sprintln(" to idle") ; stateMachine.transitionTo(idleState);
+	}
+}
+void pinExit(){Sprintln(" pin exit") ;
+	pinEntry.clear() ;													// no PIN digits left in RAM
+}
 //** end of stae machine **//
 
 // lock / unlock the door
@@ -368,26 +519,170 @@ void lockDoor(bool doorState){
 	digitalWrite(DOORLOCK, doorState?HIGH:LOW) ;						// Adapt for active low of any other door unlock
 }
 
+// card id of a Wiegand code: 26 and 34 bit codes as they are, longer formats tagged with their bit length (the
+// 35 bit code is 32 bit too, it must not match a 34 bit card)
+uint64_t cardKey(uint64_t code, int bits){
+	return bits > 34 ? (uint64_t)bits << 48 | code : code ;
+}
+
+// card id as text (buf of 16): decimal up to 32 bit (as before), tagged ids as bits:hex
+char *cardText(char *buf, uint64_t cardID){
+	unsigned long high = (cardID >> 32) & 0xFFFF, low = cardID ;
+	if (cardID >> 32 == 0){
+		sprintf(buf, "%8lu", low) ;
+	} else if (high){
+		sprintf(buf, "%u:%lX%08lX", (unsigned)(cardID >> 48), high, low) ;
+	} else {
+		sprintf(buf, "%u:%lX", (unsigned)(cardID >> 48), low) ;
+	}
+	return buf ;
+}
+
 // sends a log message to the controller containing a message and cardID
-void sendLog(unsigned long cardID, const char logMessage[]){
-	char tmpBuf[26] ;													// temporary store for message
-	sprintf(tmpBuf, "Card %8lu %-10s", cardID, logMessage);				// sends unsigned long and message (be aware of message length)
+void sendLog(uint64_t cardID, const char logMessage[]){
+	char tmpBuf[MAX_PAYLOAD + 1], idBuf[16] ;							// temporary store for message
+	snprintf(tmpBuf, sizeof(tmpBuf), "Card %s %-10s", cardText(idBuf, cardID), logMessage);	// cut to the payload
 	Sprintln(tmpBuf) ;
 	send(cardIdMsg.setSensor(CARD_ID_CHILD).set(tmpBuf));
 }
 
 // present a (new) card to the controller by presenting it and switch it to state (master, id = On, deleted = Off)
 void presentCard(byte cardIdx){
-	char tmpBuf[26] ;													// temporary store for message
-	sprintf(tmpBuf, "CardId %8lu", cardDB.readCardIdIdx(cardIdx));		// convert the cardID to text
+	char tmpBuf[26], idBuf[16] ;										// temporary store for message
+	sprintf(tmpBuf, "CardId %s", cardText(idBuf, cardDB.readCardIdIdx(cardIdx)));	// convert the cardID to text
 	Sprintln(tmpBuf) ;
 	present(cardIdx, S_BINARY, tmpBuf) ;								// present the (new) card (idx == child) to controller
 	wait(50) ;															// give it some time to settle
 	send(cardStatusMsg.setSensor(cardIdx).set(cardDB.readCardTypeIdx(cardIdx)==CardDB::delCard?0:1)); // switch according to type
 }
 
+// local time from the controller (seconds since 1-1-1970), 0 if unknown
+unsigned long localTime(){
+	if (controllerTime == 0) return 0 ;
+	return controllerTime + (millis() - timeSync) / 1000 ;
+}
+
+// sendStateTrace: trace, state statistics and current state on the state child (binary frames, see summary)
+void sendStateTrace(){
+	uint8_t frame[24] ;
+	uint8_t len = 0 ;
+	for (uint8_t i = 0 ; i < stateMachine.traceLength() ; i++){		// transitions, 4 per frame
+		const FTrace &entry = stateMachine.getTrace(i) ;
+		frame[len++] = entry.from ;
+		frame[len++] = entry.to ;
+		memcpy(frame + len, &entry.time, 4) ; len += 4 ;
+		if (len == 24 || i == stateMachine.traceLength() - 1){
+			send(stateMsg.setType(V_VAR1).set(frame, len)) ;
+			len = 0 ;
+		}
+	}
+	for (uint8_t i = 0 ; i < sizeof(states)/sizeof(states[0]) ; i++){	// states, 3 per frame
+		uint16_t entries = states[i]->getEntries() ;
+		unsigned long dwell = states[i]->getDwell() ;
+		frame[len++] = states[i]->getId() ;
+		memcpy(frame + len, &entries, 2) ; len += 2 ;
+		memcpy(frame + len, &dwell, 4) ; len += 4 ;
+		if (len == 21 || i == sizeof(states)/sizeof(states[0]) - 1){
+			send(stateMsg.setType(V_VAR2).set(frame, len)) ;
+			len = 0 ;
+		}
+	}
+	unsigned long now = millis() ;
+	frame[0] = stateMachine.getCurrentState().getId() ;
+	memcpy(frame + 1, &now, 4) ;
+	send(stateMsg.setType(V_VAR3).set(frame, 5)) ;
+}
+
+// time from the controller (answer to requestTime())
+void receiveTime(unsigned long ts){
+	controllerTime = ts ;
+	timeSync = millis() ;
+}
+
+// send the next frame of records changed since syncSince, finish with the database version
+void syncUpdate(){
+	uint8_t tmpBuf[MAX_PAYLOAD] ;
+	uint8_t len = cardDB.exportSince(syncSince, syncGeneration, syncIndex, tmpBuf, sizeof(tmpBuf)) ;
+	if (len){
+		send(cardSyncMsg.set(tmpBuf, len)) ;
+	} else {
+		send(cardVersionMsg.set(syncVersion())) ;					// end of export
+		syncActive = false ;
+	}
+}
+
+// database generation and version for the controller (V_VAR1)
+unsigned long syncVersion(){
+	return (unsigned long)cardDB.generation() << 16 | cardDB.version() ;
+}
+
+// send the Wiegand signal quality counters (two frames, see summary)
+void sendWiegandStats(){
+	wiegandStats_t stats ;
+	wg.getStats(stats) ;
+	Sprint("Wiegand edges ") ; Sprint(stats.edges[0]) ; Sprint("/") ; Sprint(stats.edges[1]) ;
+	Sprint(" frames ") ; Sprint(stats.frames) ; Sprint(" parity ") ; Sprint(stats.parity) ;
+	Sprint(" overflow ") ; Sprintln(stats.overflow) ;
+	send(wiegandMsg.setType(V_VAR1).set(&stats.edges, sizeof(stats.edges) + sizeof(stats.gaps))) ;
+	send(wiegandMsg.setType(V_VAR2).set(&stats.frames, sizeof(stats) - sizeof(stats.edges) - sizeof(stats.gaps))) ;
+}
+
 // Handle incoming messages, remote card i.e. disable/ enable
 void receive(const MyMessage &message) {  								// Expect few types of messages from controller
+	if (message.sensor == CARD_SYNC_CHILD){								// database sync
+		if (message.type == V_VAR1){									// export request since generation/ version
+			unsigned long since = message.getULong() ;
+			syncSince = (uint16_t)since ;
+			syncGeneration = since >> 16 ;
+			syncIndex = 0 ;
+			syncActive = true ;
+		} else if (message.type == V_VAR2){								// import frame, master card (index 0) protected
+			cardDB.importRecords((const uint8_t *)message.getCustom(), mGetLength(message), 1) ;
+			send(cardVersionMsg.set(syncVersion())) ;
+		} else if (message.type == V_VAR3){								// compact database
+			cardDB.compact() ;
+			send(cardVersionMsg.set(syncVersion())) ;
+		} else if (message.type == V_VAR4 && mGetLength(message) == 1 + sizeof(CardDB::accessRule_t)){ // access rule
+			const uint8_t *payload = (const uint8_t *)message.getCustom() ;
+			CardDB::accessRule_t rule ;
+			memcpy(&rule, payload + 1, sizeof(rule)) ;
+			cardDB.setRule(payload[0], rule) ;
+		} else if (message.type == V_VAR5 && mGetLength(message) == 3){	// access rule of a card
+			const uint8_t *payload = (const uint8_t *)message.getCustom() ;
+			uint16_t cardIdx = payload[0] | (payload[1] << 8) ;
+			if (cardIdx > 0 && cardIdx < cardDB.maxCards){				// not the master card
+				cardDB.setCardRuleIdx(cardIdx, payload[2]) ;
+			}
+		} else if (message.type == V_CUSTOM && mGetLength(message) == 7){	// PIN of a card
+			const uint8_t *payload = (const uint8_t *)message.getCustom() ;
+			uint16_t cardIdx = payload[0] | (payload[1] << 8) ;
+			uint32_t pin ;
+			memcpy(&pin, payload + 2, sizeof(pin)) ;
+			if (cardIdx > 0 && cardIdx < cardDB.maxCards){				// not the master card
+				cardDB.setCardPinIdx(cardIdx, pin, payload[6]) ;
+			}
+		}
+		return ;
+	}
+	if (message.sensor == WIEGAND_CHILD){								// signal quality
+		if (message.type == V_VAR1){
+			sendWiegandStats() ;
+		} else if (message.type == V_VAR3){
+			wg.clearStats() ;
+		}
+		return ;
+	}
+	if (message.sensor == STATE_CHILD){									// state machine trace
+		if (message.type == V_VAR1){
+			sendStateTrace() ;
+		} else if (message.type == V_VAR4){
+			stateMachine.clearTrace() ;
+			for (uint8_t i = 0 ; i < sizeof(states)/sizeof(states[0]) ; i++){
+				states[i]->clearStats() ;
+			}
+		}
+		return ;
+	}
 	if (message.type == V_STATUS){										// Switch "off" messages are handled as deletions
 		if (message.sensor < cardDB.maxCards && message.sensor > 0){	// take care of non existing sensors and master
 			cardDB.setCardTypeIdx( message.sensor, message.getBool()?CardDB::idCard:CardDB::delCard) ;	// set type according to payload
@@ -1,4 +1,3 @@
-
 /*
  *      This program is free software; you can redistribute it and/or modify
  *      it under the terms of the GNU General Public License as published by
@@ -22,7 +21,7 @@ By AWI () 2016
 
  PROJECT: MySensors / Multisensor
  PROGRAMMER: AWI
- DATE: August27, 2016/ last update: August 27, 2016
+ DATE: August27, 2016/ last update: October 16, 2026
  FILE: CardDB.h
  LICENSE: Public domain
 
@@ -33,11 +32,20 @@ By AWI () 2016
 Special:
 	
 Summary:
+	The database itself is a template (CardDB.h), this file holds the storage independent parts
 	
 Remarks:
 	
 Change log:
 20160727 - Updated sketch  
+20261016 - RAM copy of the DB with hashed cardID index (no EEPROM reads for lookups)
+20261016 - Template on storage backend and capacity, block reads/ writes
+20261016 - Second hash for the Bloom filter
+20261016 - CRC8 for records, journal and header
+20261016 - Salted PIN hash
+20261016 - Record CRC without the type byte
+20261016 - Record CRC with the type byte again
+20261016 - 64 bit card keys
 */
 
 #if defined(ARDUINO) && ARDUINO >= 100
@@ -48,120 +56,58 @@ Change log:
 #include "CardDB.h"
 
 
-	// Constructor
-CardDB::CardDB(){};						// 
-
-// cardType. reads the database and returns the type of card found (none, master, )
-CardDB::cardTypes_t CardDB::readCardType(uint32_t cardKey){ ;
-	int i = 0 ;
-	while ( i < MAXCARDS){
-		if (readCardEE(i).cardID == cardKey )	
-			return readCardEE(i).cardType ;
-		i++ ;
-	}
-	return noCard ;										// default = noCard
-}
-	
-//readCardType by index: 
-CardDB::cardTypes_t CardDB::readCardTypeIdx(int cardIndex){
-	return readCardEE(cardIndex).cardType ;
+// typeName: text for a card type
+const char *CardDBBase::typeName(cardTypes_t cardType){
+	return	cardType==CardDBBase::noCard?"noCard":
+			cardType==CardDBBase::idCard?"idCard":
+			cardType==CardDBBase::delCard?"delCard":"masterCard" ;
 }
 
-//readCardkey by index: 
-uint32_t CardDB::readCardIdIdx(int cardIndex){
-	return readCardEE(cardIndex).cardID ;
+// hashKey: folds the 64 bit card key to 16 bits for the index (32 bit keys hash as before)
+uint16_t CardDBBase::hashKey(uint64_t cardKey){
+	uint32_t key = (uint32_t)cardKey ^ (uint32_t)(cardKey >> 32) ;
+	uint16_t h = (uint16_t)key ^ (uint16_t)(key >> 16) ;
+	h ^= h >> 8 ;
+	return h ;
 }
 
-// readCard: reads the database and returns the card Index
-int CardDB::readCard(uint32_t cardKey){
-	int i = 0 ;
-	while ( i < MAXCARDS){
-		if (readCardEE(i).cardID == cardKey ){		
-			return i ;
-		}
-		i++ ;
-	}
-	return maxCards ;									// if not found return maxCards 
+// hashKey2: second (multiplicative) hash, always odd so all filter bits can be reached
+uint16_t CardDBBase::hashKey2(uint64_t cardKey){
+	uint32_t key = (uint32_t)cardKey ^ (uint32_t)(cardKey >> 32) ;
+	return (uint16_t)((key * 0x9E3779B1UL) >> 16) | 1 ;
 }
 
-// writeCard: writes the database and returns the card Index, maxCards if error
-int CardDB::writeCard(uint32_t cardKey){
-	int i = 0 ;
-	while (i < MAXCARDS){
-		if (readCardTypeIdx(i) == noCard){
-			CardDB::writeCardIdx(i, cardKey);
-			return i ;
-		}
-		i++ ;
+// crc8: Dallas/ Maxim CRC8 (polynomial 0x31 reflected), init 0xFF so blank storage does not pass
+uint8_t CardDBBase::crc8(const void *data, uint8_t len){
+	const uint8_t *bytes = (const uint8_t *)data ;
+	uint8_t crc = 0xFF ;
+	while (len--){
+		crc ^= *bytes++ ;
+		for (uint8_t i=0 ; i < 8 ; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x8C : crc >> 1 ;
 	}
+	return crc ;
 }
 
-// writeCard by index: writes the database
-int CardDB::writeCardIdx(int cardIndex, uint32_t cardKey){
-	recordType_t tempRec ;								// temporary storage
-	tempRec.cardID = cardKey ;					
-	tempRec.cardType = idCard ;							// default == idCard				
-	writeCardEE(cardIndex, tempRec) ;
-	return cardIndex ;
-}
-
-// setCardTypeIdx: set the card type
-bool CardDB::setCardTypeIdx(int cardIdx, cardTypes_t cardType){
-	recordType_t tempRec ;								// temporary storage
-	tempRec = readCardEE(cardIdx) ;
-	tempRec.cardType = cardType ;					
-	writeCardEE(cardIdx, tempRec) ;
-	return true ;
+// recordCrc: CRC8 of a record, the type included (a bit flip must not turn a deleted card into a master card)
+uint8_t CardDBBase::recordCrc(const recordType_t &record){
+	return crc8(&record, sizeof(record) - 1) ;
 }
 
-	
-// deleteCard: writes the database and returns the card Index, maxCards if error
-int CardDB::deleteCard(uint32_t cardKey){
-	int cardIdx = CardDB::readCard(cardKey) ;			// get the card index
-	if (cardIdx != maxCards){							// if found set type to noCard ;
-		recordType_t tempRec ;							// temporary storage
-		tempRec = readCardEE(cardIdx) ;					// read record				
-		tempRec.cardType = delCard ;					// set card to deleted
-		writeCardEE(cardIdx, tempRec) ;
-	}
-	return cardIdx ;
-};
-
-// initDB: empties the whole database
-int CardDB::initDB(){
-	recordType_t tempRec ;							// temporary storage
-	for(int i=0 ; i < MAXCARDS ; i++){
-		tempRec.cardID = 0 ;					
-		tempRec.cardType = noCard ;					
-		writeCardEE(i, tempRec) ;
+// pinHash: FNV-1a over salt, cardID, PIN and number of digits (0012 and 12 differ), folded to 16 bits, never 0
+uint16_t CardDBBase::pinHash(uint64_t cardID, uint32_t pin, uint8_t digits){
+	struct {
+		uint32_t salt ;
+		uint64_t cardID ;
+		uint32_t pin ;
+		uint8_t digits ;
+		} __attribute__((packed)) key = { CARDDB_PINSALT, cardID, pin, digits } ;
+	const uint8_t *bytes = (const uint8_t *)&key ;
+	uint32_t h = 2166136261UL ;
+	for (uint8_t i=0 ; i < sizeof(key) ; i++){
+		h ^= bytes[i] ;
+		h *= 16777619UL ;
 	}
-};
-
-// printDB: prints the whole database
-int CardDB::printDB(){
-	for (int i=0 ; i < MAXCARDS ; i++ ){
-		Serial.print(i) ; Serial.print(" ") ;
-		Serial.print(readCardEE(i).cardID); Serial.print(" ") ;
-		Serial.println(	readCardEE(i).cardType==CardDB::noCard?"noCard":
-						readCardEE(i).cardType==CardDB::idCard?"idCard":
-						readCardEE(i).cardType==CardDB::delCard?"delCard":"masterCard") ;
-	}
-};
-
-// readCardEE: reads the record from the EEPROM
-CardDB::recordType_t CardDB::readCardEE(uint8_t index){
-	convertID_t convRecord ;							// temp storage for conversion
-	for (int i=0 ; i < sizeof(convRecord); i++){
-		convRecord.cardb[i] = EEPROM.read(EEPROM_Start + index * sizeof(convRecord) + i);
-	}
-	return convRecord.cardInfo ;
-};
-// writeCardEE: reads the record from the EEPROM
-void CardDB::writeCardEE(uint8_t index, CardDB::recordType_t writeRecord){
-	convertID_t convRecord ;	// temp storage for conversion
-	convRecord.cardInfo = writeRecord ;
-	for (int i=0 ; i < sizeof(convRecord) ; i++){
-		EEPROM.write(EEPROM_Start + index * sizeof(convRecord) + i, convRecord.cardb[i]) ;
-	}
-};
-
+	uint16_t hash = (uint16_t)h ^ (uint16_t)(h >> 16) ;
+	return hash ? hash : 1 ;							// 0 = no PIN
+}
@@ -21,7 +21,7 @@ By AWI () 2016
 
  PROJECT: MySensors / Multisensor
  PROGRAMMER: AWI
- DATE: August27, 2016/ last update: August 27, 2016
+ DATE: August27, 2016/ last update: October 16, 2026
  FILE: CardDB.h
  LICENSE: Public domain
 
@@ -32,12 +32,62 @@ By AWI () 2016
 Special:
 	
 Summary:
+	CardDBT<Storage, Capacity> keeps Capacity card records in a Storage backend (see CardDBStorage.h)
+	Databases up to CACHEMAX cards are copied to RAM with a hashed index, lookups do not touch the storage.
+	Larger databases are scanned in blocks of SCANRECORDS records, a Bloom filter in RAM (BLOOMBITSPERCARD bits
+	per card within a budget of BLOOMBYTES, template parameter BloomBits) rejects most unknown cards without
+	reading the storage.
+	With JournalSize > 0 type changes and deletions are appended to a journal of JournalSize entries (ring,
+	written round robin), update() applies them to the records in the background. There is no tail pointer
+	in the storage: begin() finds the newest entry by its sequence number and replays the entries that are
+	newer than the version of their card. Record writes only write the bytes that changed, a type change
+	writes the type and the record CRC.
+	On EEPROM (byte writes) the journal costs more writes than it saves: an entry (~4 changed bytes) is written
+	on top of the same type/ version/ bitmap bytes when it is applied. Measured with tests/carddb_bench, a
+	type change changes ~6 bytes direct and ~9 through a journal of 8. The node DB writes direct (JOURNALSIZE 0),
+	a journal only pays off on storage where small appends are cheaper than record updates.
+	Every change gets the next database version, stored per card (version table) so there is no single hot
+	counter cell. exportSince()/ importRecords() pack changed records for a bulk sync with the controller.
+	Versions never wrap: after 65535 changes all cards get version 1, which forces a full resync.
+	The header holds a generation that changes with initDB(), a renumbering and a repair of the version table or
+	bitmap. The controller gets it with the version and sends it back, a different generation exports all records.
+	A bitmap (1 bit per card, set = master/ id card) keeps track of the free slots, noCard and delCard slots
+	are reused. compact() purges deleted cards and rebuilds the bitmap.
+	Each card has an access rule (0 = always). Rules 1..RULES-1 are compiled bitmasks (weekdays, hours, expiry
+	day), kept in RAM, so accessAllowed() is a few bit operations on the record that is read anyway.
+	The store starts with a header (magic, schema, layout) and every record, journal entry, the rule table and
+	the blocks of the version table and bitmap have a CRC8. begin() validates them, only a blank or foreign store
+	is initialised. Corrupt records are emptied, corrupt bitmap blocks rebuilt from the records and a corrupt
+	version table renumbered (full resync). The journal is not applied to a corrupt record.
+	A card can have a PIN (card + PIN mode), the record holds a salted 16 bit hash of it (never the PIN).
+	CardDB is the database of the cardreader node (internal EEPROM, MAXCARDS cards, JOURNALSIZE entries)
 	
 Remarks:
+	The card index is used as MySensors child id by the sketch
+	Bloom filter (tests/carddb_bench): ~1% false positives up to BLOOMBYTES * 8 / BLOOMBITSPERCARD cards (204 with
+	the defaults). Above that the default budget is full: ~10% at 512 and ~18% at 1000 cards, every false positive
+	costs a storage scan. Give large databases a bigger BloomBits if the RAM is there.
 	
 Change log:
 20160727 - Updated sketch  
 20160920 - Adapted it to use the internal EEPROM
+20261016 - RAM copy of the DB with hashed cardID index (no EEPROM reads for lookups)
+20261016 - Template on storage backend and capacity, block reads/ writes
+20261016 - Journal for type changes/ deletions (less and spread EEPROM writes)
+20261016 - Bloom filter for unknown cards in databases without RAM copy
+20261016 - Database version per card, bulk export/ import for controller sync
+20261016 - Free slot bitmap, deleted slots are reused, compact()
+20261016 - Access rules (weekdays/ hours/ expiry) per card
+20261016 - Header and CRC per record, validated at boot instead of initDB on every start
+20261016 - Salted PIN hash per card (schema 2)
+20261016 - Journal without tail byte, record CRC without the type (schema 3)
+20261016 - Bloom filter sized per card (BloomBits template parameter)
+20261016 - Versions renumbered instead of wrapping (full resync)
+20261016 - Free count and lowest free slot kept up to date, allocSlot O(1)
+20261016 - CRC per block of the version table and bitmap, journal checks the record CRC (schema 4)
+20261016 - Record CRC covers the type again (schema 5)
+20261016 - Database generation in the header, full export on a generation mismatch (schema 6)
+20261016 - 64 bit card ids, no folding of long Wiegand codes (schema 7)
 */
 
 #ifndef CardDB_h
@@ -47,17 +97,26 @@ Change log:
 
 #define MY_CORE_ONLY
 
-#include <EEPROM.h>
+#include "CardDBStorage.h"
 // #include <MySensors.h>  
 
-#define MAXCARDS 10			// maximaum number of cards in DB (limited by EEPROM size)
-#define EEPROM_Start 0x1A0	// >= MySensors eeprom EEPROM_LOCAL_CONFIG_ADDRESS
+#define MAXCARDS 10			// maximaum number of cards in DB of the node (limited by EEPROM size)
+#define CACHEMAX 32			// databases up to CACHEMAX cards are kept in RAM (13 bytes + index per card)
+#define SCANRECORDS 2		// records per block read when scanning the storage (26 bytes, fits a Wire buffer)
+#define VERSIONBLOCK 8		// card versions per CRC block of the version table (17 bytes)
+#define BITMAPBLOCK 8		// bitmap bytes (64 slots) per CRC block of the free slot bitmap (9 bytes)
+#define BLOOMBITSPERCARD 10	// Bloom filter bits per card for databases without RAM copy (~1% false positives)
+#define BLOOMBYTES 256		// default RAM budget of the Bloom filter (bytes)
+#define CARDDB_MAGIC 0xCDB1	// store header magic
+#define CARDDB_SCHEMA 7		// layout version of the store, a different schema initialises the store
+#define CARDDB_PINSALT 0x5A17C3E9UL	// salt of the PIN hashes, change per installation
+#define RULES 8				// access rules, rule 0 is always allowed (7 bytes RAM per rule)
+#define JOURNALSIZE 0		// journal entries of the node DB (power of 2 <= 128), 0 = direct writes (fewer EEPROM writes)
 
 
-class CardDB
+// common types of all card databases
+class CardDBBase
 {
-
-
 public:
 
 	enum cardTypes_t: byte
@@ -65,43 +124,242 @@ public:
 	   noCard, masterCard, idCard, delCard			// noCard = never used ; delCard = used and deleted
 	};
 
+	enum dbStatus_t: byte
+	{
+	   dbValid, dbRepaired, dbInit					// result of begin(): valid, corrupt records emptied, (re)initialised
+	};
+
 	typedef struct {
-		uint32_t cardID ;							// stores the card_id
+		uint64_t cardID ;							// stores the card_id (card key of the sketch, up to 64 bit)
 		cardTypes_t cardType ;						// holds the card RFID
-		} recordType_t ;
-	
-	typedef union {
-			recordType_t cardInfo;					// hold the cardID & type to convert to bytes
-			uint8_t cardb[5];
-		} convertID_t;
+		uint8_t cardRule ;							// access rule, 0 = always
+		uint16_t cardPin ;							// salted PIN hash, 0 = no PIN
+		uint8_t cardCrc ;							// CRC8 of the other bytes
+		} __attribute__((packed)) recordType_t ;	// 13 bytes in storage
+
+	typedef struct {
+		uint8_t days ;								// allowed weekdays, bit 0 = sunday .. bit 6 = saturday
+		uint32_t hours ;							// allowed hours, bit 0 = 00:00-00:59 .. bit 23 = 23:00-23:59
+		uint16_t expiry ;							// last allowed day (days since 1-1-1970), 0 = no expiry
+		} __attribute__((packed)) accessRule_t ;	// 7 bytes
+
+	typedef struct {
+		uint16_t cardIndex ;
+		uint64_t cardID ;
+		cardTypes_t cardType ;
+		uint8_t cardRule ;
+		} __attribute__((packed)) syncRecord_t ;	// 12 bytes (little endian) per record in a sync frame
+
+	// typeName: text for a card type
+	static const char *typeName(cardTypes_t cardType) ;
+
+	// slotUsed: master and id cards occupy their slot, noCard and delCard slots are free
+	static bool slotUsed(cardTypes_t cardType) { return cardType == masterCard || cardType == idCard ; } ;
+
+	// pinHash: salted hash of a PIN of digits digits (CARDDB_PINSALT and cardID as salt), never 0
+	static uint16_t pinHash(uint64_t cardID, uint32_t pin, uint8_t digits) ;
+
+protected:
+	typedef struct {
+		uint8_t seq ;								// sequence number, entry is valid if it follows the previous
+		uint16_t cardIndex ;
+		cardTypes_t cardType ;						// new type of the card
+		uint16_t version ;							// database version of the change
+		uint8_t crc ;								// CRC8 of the other bytes
+		} __attribute__((packed)) journalEntry_t ;	// 7 bytes in storage
+
+	typedef struct {
+		uint16_t magic ;							// CARDDB_MAGIC
+		uint8_t schema ;							// CARDDB_SCHEMA
+		uint16_t capacity ;							// layout parameters
+		uint8_t journalSize, rules ;
+		uint16_t generation ;						// changes when the versions start over (never 0)
+		uint8_t crc ;								// CRC8 of the other bytes
+		} __attribute__((packed)) dbHeader_t ;		// 10 bytes at the start of the store
+
+	typedef struct {
+		uint16_t version[VERSIONBLOCK] ;			// versions of VERSIONBLOCK cards
+		uint8_t crc ;								// CRC8 of the versions
+		} __attribute__((packed)) versionBlock_t ;
+
+	typedef struct {
+		uint8_t bits[BITMAPBLOCK] ;					// 1 bit per slot, set = master/ id card
+		uint8_t crc ;								// CRC8 of the bits
+		} __attribute__((packed)) bitmapBlock_t ;
+
+	// crc8: Dallas/ Maxim CRC8 (init 0xFF, so blank storage does not pass)
+	static uint8_t crc8(const void *data, uint8_t len) ;
+	// recordCrc: CRC8 of a record (type included)
+	static uint8_t recordCrc(const recordType_t &record) ;
+
+
+	// hashKey: folds the 64 bit card key to 16 bits for the index
+	static uint16_t hashKey(uint64_t cardKey) ;
+	// hashKey2: second (multiplicative) hash, always odd
+	static uint16_t hashKey2(uint64_t cardKey) ;
+};
+
+
+// type selection helper (no <type_traits> on AVR)
+template <bool Cond, class T, class F> struct CardSelect { typedef T type ; } ;
+template <class T, class F> struct CardSelect<false, T, F> { typedef F type ; } ;
+
+// cardIndexSize: smallest power of 2 > 2 * capacity (index is less than half full)
+constexpr uint16_t cardIndexSize(uint16_t capacity, uint16_t size = 1){
+	return size > 2 * capacity ? size : cardIndexSize(capacity, 2 * size) ;
+}
+
+
+// RAM copy of the database with an open addressing hash index on cardID (index holds card index + 1, 0 = empty)
+template <uint16_t Capacity, bool Enabled = (Capacity <= CACHEMAX)>
+class CardCache : public CardDBBase
+{
+public:
+	static const bool enabled = true ;
+	recordType_t records[Capacity] ;				// loaded in one block read at begin
+
+	// find: looks up cardKey in the index (linear probing), returns the card Index or Capacity
+	int find(uint64_t cardKey){
+		uint16_t pos = hashKey(cardKey) & (indexSize - 1) ;
+		for (uint16_t probe=0 ; probe < indexSize && _index[pos] != 0 ; probe++){
+			if (records[_index[pos] - 1].cardID == cardKey)
+				return _index[pos] - 1 ;
+			pos = (pos + 1) & (indexSize - 1) ;
+		}
+		return Capacity ;
+	}
+	// set: updates a record, rebuilds the index if the key or indexed state changes
+	void set(uint16_t index, const recordType_t &record){
+		bool reIndex = records[index].cardID != record.cardID ||
+					(records[index].cardType == noCard) != (record.cardType == noCard) ; // noCard slots are not indexed
+		records[index] = record ;
+		if (reIndex) build() ;
+	}
+	// build: (re)builds the index from the records, lowest index wins for duplicate keys
+	void build(){
+		memset(_index, 0, sizeof(_index)) ;
+		for (uint16_t i=0 ; i < Capacity ; i++){
+			if (records[i].cardType == noCard || find(records[i].cardID) != Capacity)
+				continue ;							// empty slot or duplicate key
+			uint16_t pos = hashKey(records[i].cardID) & (indexSize - 1) ;
+			while (_index[pos] != 0)
+				pos = (pos + 1) & (indexSize - 1) ;
+			_index[pos] = i + 1 ;
+		}
+	}
+private:
+	static const uint16_t indexSize = cardIndexSize(Capacity) ;
+	typename CardSelect<(Capacity < 255), uint8_t, uint16_t>::type _index[indexSize] ;
+};
+
+// no RAM copy for large databases
+template <uint16_t Capacity>
+class CardCache<Capacity, false> : public CardDBBase
+{
+public:
+	static const bool enabled = false ;
+	recordType_t records[1] ;						// not used
+	int find(uint64_t) { return Capacity ; } ;
+	void set(uint16_t, const recordType_t &) {} ;
+	void build() {} ;
+};
 
 
+// cardBloomBits: BLOOMBITSPERCARD bits per card (multiple of 8), max the BLOOMBYTES budget
+constexpr uint16_t cardBloomBits(uint16_t capacity){
+	return (uint32_t)capacity * BLOOMBITSPERCARD < BLOOMBYTES * 8UL ? ((uint32_t)capacity * BLOOMBITSPERCARD + 7) & ~7 : BLOOMBYTES * 8 ;
+}
+
+// Bloom filter on cardID of Bits bits (only for databases without RAM copy, the cache index is exact)
+template <uint16_t Capacity, uint16_t Bits = cardBloomBits(Capacity), bool Enabled = (Capacity > CACHEMAX)>
+class CardBloom : public CardDBBase
+{
+public:
+	static const bool enabled = true ;
+	// clear: empties the filter
+	void clear(){
+		memset(_bits, 0, sizeof(_bits)) ;
+	}
+	// add: adds the card key
+	void add(uint64_t cardKey){
+		uint16_t h1 = hashKey(cardKey), h2 = hashKey2(cardKey) ;
+		for (uint8_t i=0 ; i < hashes ; i++, h1 += h2){
+			uint16_t bit = position(h1) ;
+			_bits[bit >> 3] |= 1 << (bit & 7) ;
+		}
+	}
+	// mayContain: false if the card key is certainly not in the database
+	bool mayContain(uint64_t cardKey){
+		uint16_t h1 = hashKey(cardKey), h2 = hashKey2(cardKey) ;
+		for (uint8_t i=0 ; i < hashes ; i++, h1 += h2){
+			uint16_t bit = position(h1) ;
+			if (!(_bits[bit >> 3] & (1 << (bit & 7))))
+				return false ;
+		}
+		return true ;
+	}
+private:
+	static_assert(Bits >= 8 && Bits % 8 == 0, "BloomBits must be a multiple of 8") ;
+	static const uint8_t hashes = Bits * 11UL / 16 / Capacity < 1 ? 1 :	// optimal = bits/ cards * ln(2), 1..8
+								Bits * 11UL / 16 / Capacity > 8 ? 8 : Bits * 11UL / 16 / Capacity ;
+	uint8_t _bits[Bits / 8] ;
+	// position: maps a 16 bit hash on 0..Bits-1 (multiply and shift, Bits needs not be a power of 2)
+	static uint16_t position(uint16_t hash) { return ((uint32_t)hash * Bits) >> 16 ; } ;
+};
+
+// no filter for cached databases
+template <uint16_t Capacity, uint16_t Bits>
+class CardBloom<Capacity, Bits, false>
+{
+public:
+	static const bool enabled = false ;
+	void clear() {} ;
+	void add(uint64_t) {} ;
+	bool mayContain(uint64_t) { return true ; } ;
+};
+
+
+template <class Storage, uint16_t Capacity, uint8_t JournalSize = 0, uint16_t BloomBits = cardBloomBits(Capacity)>
+class CardDBT : public CardDBBase
+{
+	static_assert(JournalSize <= 128 && (JournalSize & (JournalSize - 1)) == 0, "JournalSize must be 0 or a power of 2 <= 128") ;
+
+
+public:
+
 	// Constructor
-	CardDB() ;						// attach pin & set state
+	CardDBT(Storage &storage) ;						// attach storage
+
+	// begin: starts the storage, validates the store (initDB if blank or foreign, repairs corrupt records),
+	// loads the database in RAM if it fits and replays the journal (call once in setup)
+	dbStatus_t begin();
+
+	// update: compacts the journal in the background (max one record write per call), call every loop
+	void update();
 
 	// cardType. reads the database and returns the type of card found (noCard, masterCard, idCard, delCard)
-	cardTypes_t readCardType(uint32_t cardKey) ;
+	cardTypes_t readCardType(uint64_t cardKey) ;
 
 	//readCardType by index: 
 	cardTypes_t readCardTypeIdx(int cardIndex);
 
 	//readCardID by index: 
-	uint32_t readCardIdIdx(int cardIndex);
+	uint64_t readCardIdIdx(int cardIndex);
 
 	// readCard: reads the database and return the card Index
-	int readCard(uint32_t cardKey);
+	int readCard(uint64_t cardKey);
 
-	// writeCard: writes the database and returns the card Index, maxCards if error
-	int writeCard(uint32_t cardKey);
+	// writeCard: writes the card in a free (or deleted) slot and returns the card Index, maxCards if full
+	int writeCard(uint64_t cardKey);
 
 	// writeCard by index: writes the database
-	int writeCardIdx(int cardIndex, uint32_t cardKey);
+	int writeCardIdx(int cardIndex, uint64_t cardKey);
 
-	// setCardType by index: writes the database 
+	// setCardType by index: writes the database, false if the index is out of range
 	bool setCardTypeIdx(int cardIdx, cardTypes_t cardType);
 	
 	// deleteCard: writes the database and returns the card Index, NULL if error
-	int deleteCard(uint32_t cardKey);
+	int deleteCard(uint64_t cardKey);
 
 	// clearDB: empties the whole database
 	int initDB();
@@ -109,19 +367,853 @@ public:
 	// printDB: empties the whole database
 	int printDB();
 
-	const int maxCards = MAXCARDS ;					// error value
+	// setCardRuleIdx: sets the access rule of the card
+	bool setCardRuleIdx(int cardIdx, uint8_t cardRule);
+
+	// readCardRuleIdx: access rule of the card
+	uint8_t readCardRuleIdx(int cardIdx);
+
+	// setRule: stores access rule 1..RULES-1
+	bool setRule(uint8_t rule, const accessRule_t &accessRule);
+
+	// setCardPinIdx: stores the salted hash of the PIN (digits long) in the record, digits 0 removes the PIN
+	bool setCardPinIdx(int cardIdx, uint32_t pin, uint8_t digits);
+
+	// cardHasPinIdx: true if the card needs a PIN (card + PIN mode)
+	bool cardHasPinIdx(int cardIdx);
+
+	// checkPinIdx: true if the PIN matches the hash in the record (or the card has no PIN)
+	bool checkPinIdx(int cardIdx, uint32_t pin, uint8_t digits);
+
+	// accessAllowed: checks the access rule of the card for local time now (seconds since 1-1-1970, 0 = unknown).
+	// Master cards and rule 0 are always allowed, other rules never if the time is unknown
+	bool accessAllowed(int cardIdx, uint32_t now);
+
+	// compact: applies the journal, purges deleted cards (noCard) and rebuilds the free slot bitmap.
+	// Cards are not moved (the index is the MySensors child id). Returns the number of purged cards
+	uint16_t compact();
+
+	// version: database version, incremented on every change (all cards get version 1 when it would wrap)
+	uint16_t version() { return _version ; } ;
+
+	// generation: changes when the database starts over (initDB, renumbering, repaired version table or bitmap)
+	uint16_t generation() { return _generation ; } ;
+
+	// exportSince: packs records changed after version since of generation in buf (syncRecord_t), starts at
+	// cardIndex and advances it, returns the bytes used (0 = done). Another generation or a since newer than the
+	// database exports all records (empty ones too)
+	uint8_t exportSince(uint16_t since, uint16_t generation, uint16_t &cardIndex, uint8_t *buf, uint8_t size);
+
+	// importRecords: writes the records packed in buf (syncRecord_t), records below minIndex are protected and
+	// master cards are never imported (only id, deleted and empty records). Returns the number of records imported
+	uint8_t importRecords(const uint8_t *buf, uint8_t len, uint16_t minIndex = 0);
+
+	static const int maxCards = Capacity ;			// error value
+	static const uint32_t recordsAddr = sizeof(dbHeader_t) ;	// records follow the header
+	static const uint32_t journalAddr = recordsAddr + (uint32_t)Capacity * sizeof(recordType_t) ; // journal entries (ring)
+	static const uint16_t versionBlocks = (Capacity + VERSIONBLOCK - 1) / VERSIONBLOCK ;
+	static const uint16_t bitmapBlocks = (Capacity + 8 * BITMAPBLOCK - 1) / (8 * BITMAPBLOCK) ;
+	static const uint32_t versionAddr = journalAddr + JournalSize * sizeof(journalEntry_t) ; // version per card (blocks with CRC)
+	static const uint32_t bitmapAddr = versionAddr + versionBlocks * sizeof(versionBlock_t) ; // free slot bitmap (blocks with CRC)
+	static const uint32_t rulesAddr = bitmapAddr + bitmapBlocks * sizeof(bitmapBlock_t) ; // rules 1..RULES-1
+	static const uint32_t storageSize = rulesAddr + (RULES - 1) * sizeof(accessRule_t) + 1 ; // bytes used in the storage (rules + CRC)
 	
 private:
-	recordType_t cardDatabase[MAXCARDS] ;
-	unsigned long  _flash_freq, _flashPulse, _flashPause ; // frequency (=period), pulse and pause width in ms
-	unsigned long  _lastUpdate, _flashTime, _count, _flashCount ;  // period, counters ()
-	uint8_t _curState, _flash_stat ; 
-	bool _flashTimer, _flashCounter, _activeHigh ; // status flags
-	uint8_t _pin;
-
-	// readCardEE: reads the record from the EEPROM
-	recordType_t readCardEE(uint8_t index);
-	// writeCardEE: reads the record from the EEPROM
-	void writeCardEE(uint8_t index, recordType_t convRecord);	
-};
-#endif
\ No newline at end of file
+	Storage &_storage ;
+	CardCache<Capacity> _cache ;					// RAM copy (only if Capacity <= CACHEMAX)
+	CardBloom<Capacity, BloomBits> _bloom ;		// fast reject (only if Capacity > CACHEMAX)
+	journalEntry_t _journal[JournalSize ? JournalSize : 1] ;	// RAM copy of the pending journal entries, oldest first
+	uint8_t _journalTail, _journalCount, _journalApplied ;	// sequence of the oldest pending entry, pending entries, entries applied by update()
+	uint16_t _version ;								// database version (highest card version)
+	uint16_t _generation ;							// database generation (header)
+	uint16_t _freeCount, _firstFree ;				// free slots in the bitmap and the lowest one (Capacity = none)
+	accessRule_t _rules[RULES - 1] ;				// RAM copy of rules 1..RULES-1
+
+	// recordAddr: storage address of a record
+	static uint32_t recordAddr(uint16_t index) { return recordsAddr + (uint32_t)index * sizeof(recordType_t) ; } ;
+	// repairRecord: empties a record with a bad CRC
+	void repairRecord(uint16_t index);
+	// storeRecord: writes the changed bytes of the record with a new CRC to the storage
+	void storeRecord(uint16_t index, const recordType_t &record);
+	// readRecord: reads the record from RAM or storage (with pending journal entries), noCard if out of range
+	recordType_t readRecord(uint16_t index);
+	// writeRecord: writes the changed bytes of the record to the storage (and RAM), nothing if out of range
+	void writeRecord(uint16_t index, const recordType_t &record);
+	// writeType: changes the card type, through the journal if there is one
+	void writeType(uint16_t index, cardTypes_t cardType);
+	// overlayType: type of the card after the pending journal entries
+	cardTypes_t overlayType(uint16_t index, cardTypes_t cardType);
+	// findJournal: newest pending journal entry for the card, -1 if none
+	int8_t findJournal(uint16_t index);
+	// allocSlot: first free slot (pending journal entries first, then the bitmap), maxCards if full
+	uint16_t allocSlot();
+	// nextFree: first slot from index with a clear bit in the bitmap, Capacity if none
+	uint16_t nextFree(uint16_t index);
+	// checkBitmap: rebuilds corrupt bitmap blocks from the records, counts the free slots and finds the lowest one
+	bool checkBitmap();
+	// readBitmap: reads a block of the bitmap, false if its CRC is bad
+	bool readBitmap(uint16_t block, bitmapBlock_t &bitmap);
+	// writeBit: sets the bitmap bit of a slot (only writes if it changes), keeps the free count and lowest free slot
+	void writeBit(uint16_t index, bool used);
+	// readVersion: version of the card (with pending journal entries)
+	uint16_t readVersion(uint16_t index);
+	// readVersions: reads a block of the version table, false if its CRC is bad
+	bool readVersions(uint16_t block, versionBlock_t &versions);
+	// writeVersion: writes the version of a card and the CRC of its block
+	void writeVersion(uint16_t index, uint16_t version);
+	// writeHeader: writes the store header (layout and generation)
+	void writeHeader();
+	// newGeneration: next generation in the header, the controller's versions no longer count
+	void newGeneration();
+	// nextVersion: version for a change, renumbers all cards when the version would wrap
+	uint16_t nextVersion();
+	// resetVersions: sets all card versions and the database version, invalidates the journal
+	void resetVersions(uint16_t version);
+	// readJournal: reads the entry in a slot of the ring, false if it is not valid
+	bool readJournal(uint8_t slot, journalEntry_t &entry);
+	// loadJournal: loads the pending entries (newest entries down to the first one already applied)
+	void loadJournal();
+	// appendJournal: writes a journal entry, compacts first if the journal is full
+	void appendJournal(uint16_t index, cardTypes_t cardType, uint16_t version);
+	// applyJournal: writes type and version of a journal entry to its record (if not overruled by a later entry)
+	void applyJournal(uint8_t entry);
+	// flushJournal: applies all pending entries
+	void flushJournal();
+	// scanStorage: block scan for cardKey, returns the card Index or maxCards
+	int scanStorage(uint64_t cardKey);
+};
+
+// the database of the cardreader node
+typedef CardDBT<EEPROMStorage, MAXCARDS, JOURNALSIZE> CardDB ;
+
+
+	// Constructor
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+CardDBT<Storage, Capacity, JournalSize, BloomBits>::CardDBT(Storage &storage) : _storage(storage) {
+	_journalTail = _journalCount = _journalApplied = 0 ;
+	_version = _generation = _freeCount = _firstFree = 0 ;
+} ;
+
+// begin: validates the store, loads the database in RAM if it fits and replays the journal
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+CardDBBase::dbStatus_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::begin(){
+	_storage.begin() ;
+	dbHeader_t header ;
+	_storage.read(0, &header, sizeof(header)) ;
+	if (header.magic != CARDDB_MAGIC || header.schema != CARDDB_SCHEMA || header.capacity != Capacity ||
+			header.journalSize != JournalSize || header.rules != RULES || header.crc != crc8(&header, sizeof(header) - 1)){
+		initDB() ;										// blank, foreign or other layout
+		return dbInit ;
+	}
+	_generation = header.generation ;
+	bool repaired = false ;
+	uint8_t rulesCrc ;
+	_storage.read(rulesAddr, _rules, sizeof(_rules)) ;
+	_storage.read(rulesAddr + sizeof(_rules), &rulesCrc, 1) ;
+	if (rulesCrc != crc8(_rules, sizeof(_rules))){		// corrupt rules never allow access
+		memset(_rules, 0, sizeof(_rules)) ;
+		rulesCrc = crc8(_rules, sizeof(_rules)) ;
+		_storage.write(rulesAddr, _rules, sizeof(_rules)) ;
+		_storage.write(rulesAddr + sizeof(_rules), &rulesCrc, 1) ;
+		repaired = true ;
+	}
+	versionBlock_t versions ;							// database version = highest card version
+	bool versionsCorrupt = false ;
+	_version = 0 ;
+	for (uint16_t b=0 ; b < versionBlocks ; b++){
+		if (!readVersions(b, versions)){
+			versionsCorrupt = true ;
+			continue ;
+		}
+		for (uint8_t j=0 ; j < VERSIONBLOCK ; j++){
+			if (versions.version[j] > _version) _version = versions.version[j] ;
+		}
+	}
+	if (JournalSize)
+		loadJournal() ;
+	if (checkBitmap()){									// corrupt blocks are rebuilt from the records
+		newGeneration() ;
+		repaired = true ;
+	}
+	if (versionsCorrupt){								// changes unknown: apply the journal and renumber (full resync)
+		if (_journalCount)
+			flushJournal() ;
+		newGeneration() ;
+		resetVersions(1) ;
+		repaired = true ;
+	}
+	if (_cache.enabled){
+		_storage.read(recordsAddr, _cache.records, sizeof(_cache.records)) ;	// one block read
+		for (uint16_t i=0 ; i < Capacity ; i++){
+			if (_cache.records[i].cardCrc != recordCrc(_cache.records[i]) || _cache.records[i].cardType > delCard){
+				repairRecord(i) ;
+				repaired = true ;
+			}
+		}
+		for (uint8_t i=0 ; i < _journalCount ; i++){	// replay the journal in RAM
+			_cache.records[_journal[i].cardIndex].cardType = _journal[i].cardType ;
+		}
+		_cache.build() ;
+	} else {											// check the storage and fill the filter (after the journal)
+		recordType_t block[SCANRECORDS] ;
+		_bloom.clear() ;
+		for (uint16_t i=0 ; i < Capacity ; i += SCANRECORDS){
+			uint8_t n = Capacity - i < SCANRECORDS ? Capacity - i : SCANRECORDS ;
+			_storage.read(recordAddr(i), block, n * sizeof(recordType_t)) ;
+			for (uint8_t j=0 ; j < n ; j++){
+				if (block[j].cardCrc != recordCrc(block[j]) || block[j].cardType > delCard){
+					repairRecord(i + j) ;
+					repaired = true ;
+				} else if (overlayType(i + j, block[j].cardType) != noCard){
+					_bloom.add(block[j].cardID) ;
+				}
+			}
+		}
+	}
+	return repaired ? dbRepaired : dbValid ;
+}
+
+// update: compacts the journal in the background when it is half full
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::update(){
+	if (JournalSize == 0 || _journalCount < JournalSize / 2)
+		return ;
+	if (_journalApplied < _journalCount){
+		applyJournal(_journalApplied++) ;				// one record per call
+	} else {
+		flushJournal() ;								// all applied, only moves the tail
+	}
+}
+
+// cardType. reads the database and returns the type of card found (none, master, )
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+CardDBBase::cardTypes_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::readCardType(uint64_t cardKey){
+	int cardIdx = readCard(cardKey) ;
+	if (cardIdx != maxCards)
+		return readRecord(cardIdx).cardType ;
+	return noCard ;										// default = noCard
+}
+	
+//readCardType by index: 
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+CardDBBase::cardTypes_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::readCardTypeIdx(int cardIndex){
+	return readRecord(cardIndex).cardType ;
+}
+
+//readCardkey by index: 
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint64_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::readCardIdIdx(int cardIndex){
+	return readRecord(cardIndex).cardID ;
+}
+
+// readCard: reads the database and returns the card Index
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::readCard(uint64_t cardKey){
+	if (_cache.enabled)
+		return _cache.find(cardKey) ;					// if not found returns maxCards 
+	if (!_bloom.mayContain(cardKey))
+		return maxCards ;								// certainly unknown, no storage reads
+	return scanStorage(cardKey) ;
+}
+
+// writeCard: writes the card in a free (or deleted) slot and returns the card Index, maxCards if full
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeCard(uint64_t cardKey){
+	int i = allocSlot() ;
+	if (i != maxCards)
+		writeCardIdx(i, cardKey) ;
+	return i ;
+}
+
+// writeCard by index: writes the database
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeCardIdx(int cardIndex, uint64_t cardKey){
+	recordType_t tempRec ;								// temporary storage
+	tempRec.cardID = cardKey ;					
+	tempRec.cardType = idCard ;							// default == idCard				
+	tempRec.cardRule = 0 ;								// always allowed
+	tempRec.cardPin = 0 ;								// no PIN
+	writeRecord(cardIndex, tempRec) ;
+	return cardIndex ;
+}
+
+// setCardTypeIdx: set the card type, false if the index is out of range
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::setCardTypeIdx(int cardIdx, cardTypes_t cardType){
+	if (cardIdx < 0 || cardIdx >= maxCards)
+		return false ;
+	writeType(cardIdx, cardType) ;
+	return true ;
+}
+
+	
+// deleteCard: writes the database and returns the card Index, maxCards if error
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::deleteCard(uint64_t cardKey){
+	int cardIdx = readCard(cardKey) ;					// get the card index
+	if (cardIdx != maxCards){							// if found set type to noCard ;
+		writeType(cardIdx, delCard) ;					// set card to deleted (stays in index)
+	}
+	return cardIdx ;
+};
+
+// initDB: empties the whole database
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::initDB(){
+	recordType_t block[SCANRECORDS] ;					// write empty records in blocks
+	memset(block, 0, sizeof(block)) ;					// cardID 0, noCard
+	for (uint8_t j=0 ; j < SCANRECORDS ; j++){
+		block[j].cardCrc = recordCrc(block[j]) ;
+	}
+	for (uint16_t i=0 ; i < Capacity ; i += SCANRECORDS){
+		uint16_t n = Capacity - i < SCANRECORDS ? Capacity - i : SCANRECORDS ;
+		_storage.write(recordAddr(i), block, n * sizeof(recordType_t)) ;
+	}
+	if (_cache.enabled){
+		for (uint16_t i=0 ; i < Capacity ; i++){
+			_cache.records[i] = block[0] ;
+		}
+		_cache.build() ;
+	}
+	_bloom.clear() ;
+	_journalCount = _journalApplied = 0 ;
+	resetVersions(0) ;									// all versions 0, no journal entries
+	bitmapBlock_t bitmap ;								// all slots free
+	memset(bitmap.bits, 0, sizeof(bitmap.bits)) ;
+	bitmap.crc = crc8(bitmap.bits, sizeof(bitmap.bits)) ;
+	for (uint16_t b=0 ; b < bitmapBlocks ; b++){
+		_storage.write(bitmapAddr + b * sizeof(bitmap), &bitmap, sizeof(bitmap)) ;
+	}
+	memset(_rules, 0, sizeof(_rules)) ;					// rules never allow access
+	_storage.write(rulesAddr, _rules, sizeof(_rules)) ;
+	uint8_t rulesCrc = crc8(_rules, sizeof(_rules)) ;
+	_storage.write(rulesAddr + sizeof(_rules), &rulesCrc, 1) ;
+	_freeCount = Capacity ;
+	_firstFree = 0 ;
+	dbHeader_t header ;									// generation after the stored one (also if the header is corrupt)
+	_storage.read(0, &header, sizeof(header)) ;
+	_generation = (uint16_t)(header.generation + 1) ? header.generation + 1 : 1 ;
+	writeHeader() ;										// last, an interrupted init is redone at the next boot
+	return maxCards ;
+};
+
+// writeHeader: writes the store header (layout and generation)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeHeader(){
+	dbHeader_t header = { CARDDB_MAGIC, CARDDB_SCHEMA, Capacity, JournalSize, RULES, _generation, 0 } ;
+	header.crc = crc8(&header, sizeof(header) - 1) ;
+	_storage.write(0, &header, sizeof(header)) ;
+};
+
+// newGeneration: next generation (never 0, a request without generation always gets a full export), written before
+// the versions start over so an interrupted renumbering still shows up
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::newGeneration(){
+	if (++_generation == 0)
+		_generation = 1 ;
+	writeHeader() ;
+};
+
+// printDB: prints the whole database
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::printDB(){
+	for (int i=0 ; i < maxCards ; i++ ){
+		recordType_t tempRec = readRecord(i) ;
+		Serial.print(i) ; Serial.print(" ") ;
+		Serial.print(tempRec.cardID); Serial.print(" ") ;
+		Serial.println(typeName(tempRec.cardType)) ;
+	}
+	return maxCards ;
+};
+
+// setCardRuleIdx: sets the access rule of the card (only the rule byte is written)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::setCardRuleIdx(int cardIdx, uint8_t cardRule){
+	if (cardRule >= RULES || cardIdx < 0 || cardIdx >= maxCards)
+		return false ;
+	recordType_t tempRec = readRecord(cardIdx) ;
+	if (tempRec.cardRule != cardRule){
+		tempRec.cardRule = cardRule ;
+		writeRecord(cardIdx, tempRec) ;
+	}
+	return true ;
+}
+
+// readCardRuleIdx: access rule of the card
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint8_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::readCardRuleIdx(int cardIdx){
+	return readRecord(cardIdx).cardRule ;
+}
+
+// setRule: stores access rule 1..RULES-1
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::setRule(uint8_t rule, const accessRule_t &accessRule){
+	if (rule == 0 || rule >= RULES)
+		return false ;
+	_rules[rule - 1] = accessRule ;
+	_storage.write(rulesAddr + (rule - 1) * sizeof(accessRule_t), &accessRule, sizeof(accessRule)) ;
+	uint8_t rulesCrc = crc8(_rules, sizeof(_rules)) ;
+	_storage.write(rulesAddr + sizeof(_rules), &rulesCrc, 1) ;
+	return true ;
+}
+
+// setCardPinIdx: stores the salted hash of the PIN in the record, digits 0 removes the PIN
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::setCardPinIdx(int cardIdx, uint32_t pin, uint8_t digits){
+	recordType_t tempRec = readRecord(cardIdx) ;
+	if (!slotUsed(tempRec.cardType))
+		return false ;
+	uint16_t cardPin = digits ? pinHash(tempRec.cardID, pin, digits) : 0 ;
+	if (tempRec.cardPin != cardPin){
+		tempRec.cardPin = cardPin ;
+		writeRecord(cardIdx, tempRec) ;
+	}
+	return true ;
+}
+
+// cardHasPinIdx: true if the card needs a PIN
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::cardHasPinIdx(int cardIdx){
+	return readRecord(cardIdx).cardPin != 0 ;
+}
+
+// checkPinIdx: true if the PIN matches the hash in the record (or the card has no PIN)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::checkPinIdx(int cardIdx, uint32_t pin, uint8_t digits){
+	recordType_t tempRec = readRecord(cardIdx) ;
+	return tempRec.cardPin == 0 || tempRec.cardPin == pinHash(tempRec.cardID, pin, digits) ;
+}
+
+// accessAllowed: checks the access rule of the card for local time now
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::accessAllowed(int cardIdx, uint32_t now){
+	recordType_t tempRec = readRecord(cardIdx) ;
+	if (tempRec.cardRule == 0 || tempRec.cardType == masterCard)
+		return true ;
+	if (now == 0 || tempRec.cardRule >= RULES)
+		return false ;									// time unknown or invalid rule
+	const accessRule_t &rule = _rules[tempRec.cardRule - 1] ;
+	uint16_t day = now / 86400UL ;
+	uint8_t hour = (now % 86400UL) / 3600 ;
+	uint8_t weekday = (day + 4) % 7 ;					// 1-1-1970 was a thursday
+	return (rule.days >> weekday) & (rule.hours >> hour) & 1 && (rule.expiry == 0 || day <= rule.expiry) ;
+}
+
+// compact: applies the journal, purges deleted cards and rebuilds the free slot bitmap
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint16_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::compact(){
+	uint16_t purged = 0 ;
+	if (_journalCount)
+		flushJournal() ;
+	for (uint16_t i=0 ; i < Capacity ; i++){
+		recordType_t tempRec = readRecord(i) ;
+		if (tempRec.cardType == delCard){
+			tempRec.cardID = 0 ;
+			tempRec.cardType = noCard ;
+			tempRec.cardRule = 0 ;
+			tempRec.cardPin = 0 ;
+			writeRecord(i, tempRec) ;
+			purged++ ;
+		}
+		writeBit(i, slotUsed(tempRec.cardType)) ;		// repairs bits left by an interrupted write
+	}
+	return purged ;
+};
+
+// exportSince: packs records changed after version since in buf, returns the bytes used (0 = done)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint8_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::exportSince(uint16_t since, uint16_t generation, uint16_t &cardIndex, uint8_t *buf, uint8_t size){
+	bool all = generation != _generation || since > _version ;	// database started over (or controller ahead): export all
+	uint8_t len = 0 ;
+	while (cardIndex < Capacity && len + sizeof(syncRecord_t) <= size){
+		if (all || readVersion(cardIndex) > since){
+			recordType_t tempRec = readRecord(cardIndex) ;
+			syncRecord_t syncRec = { cardIndex, tempRec.cardID, tempRec.cardType, tempRec.cardRule } ;
+			memcpy(buf + len, &syncRec, sizeof(syncRec)) ;
+			len += sizeof(syncRec) ;
+		}
+		cardIndex++ ;
+	}
+	return len ;
+};
+
+// importRecords: writes the records packed in buf, returns the number of records imported
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint8_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::importRecords(const uint8_t *buf, uint8_t len, uint16_t minIndex){
+	uint8_t count = 0 ;
+	for ( ; len >= sizeof(syncRecord_t) ; buf += sizeof(syncRecord_t), len -= sizeof(syncRecord_t)){
+		syncRecord_t syncRec ;
+		memcpy(&syncRec, buf, sizeof(syncRec)) ;
+		if (syncRec.cardIndex < minIndex || syncRec.cardIndex >= Capacity || syncRec.cardType > delCard ||
+				syncRec.cardType == masterCard || syncRec.cardRule >= RULES)
+			continue ;									// protected, a master card or invalid
+		recordType_t tempRec = readRecord(syncRec.cardIndex) ;
+		if (tempRec.cardID == syncRec.cardID){
+			writeType(syncRec.cardIndex, syncRec.cardType) ;	// same card, only the type (journal)
+			setCardRuleIdx(syncRec.cardIndex, syncRec.cardRule) ;
+		} else {
+			tempRec.cardID = syncRec.cardID ;
+			tempRec.cardType = syncRec.cardType ;
+			tempRec.cardRule = syncRec.cardRule ;
+			tempRec.cardPin = 0 ;						// the PIN belonged to the previous card
+			writeRecord(syncRec.cardIndex, tempRec) ;
+		}
+		count++ ;
+	}
+	return count ;
+};
+
+// readRecord: reads the record from RAM or storage, an empty record (noCard) if the index is out of range
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+CardDBBase::recordType_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::readRecord(uint16_t index){
+	recordType_t tempRec ;
+	if (index >= Capacity){								// the by-index readers take any int
+		memset(&tempRec, 0, sizeof(tempRec)) ;
+		return tempRec ;
+	}
+	if (_cache.enabled)
+		return _cache.records[index] ;
+	_storage.read(recordAddr(index), &tempRec, sizeof(tempRec)) ;
+	tempRec.cardType = overlayType(index, tempRec.cardType) ;
+	return tempRec ;
+};
+
+// repairRecord: empties a record with a bad CRC (new version, so the controller sees it)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::repairRecord(uint16_t index){
+	recordType_t tempRec ;
+	memset(&tempRec, 0, sizeof(tempRec)) ;				// cardID 0, noCard
+	writeRecord(index, tempRec) ;
+};
+
+// storeRecord: writes the changed bytes of the record with a new CRC to the storage
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::storeRecord(uint16_t index, const recordType_t &record){
+	recordType_t newRec = record, stored ;				// record as it is in the storage (without journal)
+	newRec.cardCrc = recordCrc(newRec) ;
+	_storage.read(recordAddr(index), &stored, sizeof(stored)) ;
+	const uint8_t *newBytes = (const uint8_t *)&newRec, *oldBytes = (const uint8_t *)&stored ;
+	uint8_t first = 0, last = sizeof(newRec) ;
+	while (first < last && newBytes[first] == oldBytes[first]) first++ ;
+	while (last > first && newBytes[last - 1] == oldBytes[last - 1]) last-- ;
+	if (first < last)
+		_storage.write(recordAddr(index) + first, newBytes + first, last - first) ;
+};
+
+// writeRecord: writes the changed bytes of the record to the storage and keeps the RAM copy coherent
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeRecord(uint16_t index, const recordType_t &record){
+	if (index >= Capacity)
+		return ;
+	uint16_t version = nextVersion() ;					// first, a renumbering flushes the journal
+	storeRecord(index, record) ;
+	writeVersion(index, version) ;
+	writeBit(index, slotUsed(record.cardType)) ;
+	if (JournalSize && findJournal(index) >= 0)
+		appendJournal(index, record.cardType, version) ;			// pending entries for this index, the journal needs the last word
+	_cache.set(index, record) ;
+	if (record.cardType != noCard)
+		_bloom.add(record.cardID) ;						// old key stays in the filter until the next boot
+};
+
+// writeType: changes the card type, through the journal if there is one
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeType(uint16_t index, cardTypes_t cardType){
+	recordType_t tempRec = readRecord(index) ;
+	if (tempRec.cardType == cardType)
+		return ;										// nothing changed, nothing written
+	tempRec.cardType = cardType ;
+	if (JournalSize == 0){
+		writeRecord(index, tempRec) ;
+		return ;
+	}
+	appendJournal(index, cardType, nextVersion()) ;
+	_cache.set(index, tempRec) ;
+	if (cardType != noCard)
+		_bloom.add(tempRec.cardID) ;
+};
+
+// overlayType: type of the card after the pending journal entries (newest first)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+CardDBBase::cardTypes_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::overlayType(uint16_t index, cardTypes_t cardType){
+	int8_t entry = findJournal(index) ;
+	return entry < 0 ? cardType : _journal[entry].cardType ;
+};
+
+// allocSlot: first free slot (pending journal entries first, then the bitmap), maxCards if full.
+// O(1): the lowest free slot is kept by writeBit, a full database is known from the free count
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint16_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::allocSlot(){
+	for (uint8_t j=0 ; j < _journalCount ; j++){		// freed but not yet in the bitmap
+		if (!slotUsed(_journal[j].cardType) && findJournal(_journal[j].cardIndex) == j)
+			return _journal[j].cardIndex ;
+	}
+	while (_freeCount){
+		if (!slotUsed(readRecord(_firstFree).cardType))
+			return _firstFree ;
+		writeBit(_firstFree, true) ;					// bit lost by an interrupted write, never overwrite a card
+	}
+	return maxCards ;
+};
+
+// nextFree: first slot from index with a clear bit in the bitmap, Capacity if none (reads 64 slots at a time)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint16_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::nextFree(uint16_t index){
+	bitmapBlock_t bitmap ;
+	for (uint16_t b = index / (8 * BITMAPBLOCK) ; b < bitmapBlocks ; b++){
+		readBitmap(b, bitmap) ;
+		for (uint8_t k=0 ; k < BITMAPBLOCK ; k++){
+			if (bitmap.bits[k] == 0xFF)
+				continue ;								// 8 used slots
+			for (uint8_t j=0 ; j < 8 ; j++){
+				uint16_t slot = (b * BITMAPBLOCK + k) * 8 + j ;
+				if (slot >= index && slot < Capacity && !(bitmap.bits[k] & (1 << j)))
+					return slot ;
+			}
+		}
+	}
+	return Capacity ;
+};
+
+// checkBitmap: rebuilds bitmap blocks with a bad CRC from the records, counts the free slots and finds the lowest
+// one (begin, after the journal is loaded). True if a block was rebuilt
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::checkBitmap(){
+	bitmapBlock_t bitmap ;
+	bool rebuilt = false ;
+	_freeCount = 0 ;
+	_firstFree = Capacity ;
+	for (uint16_t b=0 ; b < bitmapBlocks ; b++){
+		uint16_t first = b * 8 * BITMAPBLOCK ;
+		if (!readBitmap(b, bitmap)){
+			memset(bitmap.bits, 0, sizeof(bitmap.bits)) ;
+			for (uint16_t i = first ; i < Capacity && i < first + 8 * BITMAPBLOCK ; i++){
+				recordType_t stored ;
+				_storage.read(recordAddr(i), &stored, sizeof(stored)) ;
+				if (stored.cardCrc == recordCrc(stored) && slotUsed(overlayType(i, stored.cardType)))
+					bitmap.bits[(i - first) >> 3] |= 1 << (i & 7) ;
+			}
+			bitmap.crc = crc8(bitmap.bits, sizeof(bitmap.bits)) ;
+			_storage.write(bitmapAddr + b * sizeof(bitmap), &bitmap, sizeof(bitmap)) ;
+			rebuilt = true ;
+		}
+		for (uint16_t i = first ; i < Capacity && i < first + 8 * BITMAPBLOCK ; i++){
+			if (bitmap.bits[(i - first) >> 3] & (1 << (i & 7)))
+				continue ;
+			if (_freeCount++ == 0)
+				_firstFree = i ;
+		}
+	}
+	return rebuilt ;
+};
+
+// readBitmap: reads a block of the bitmap, false if its CRC is bad
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::readBitmap(uint16_t block, bitmapBlock_t &bitmap){
+	_storage.read(bitmapAddr + block * sizeof(bitmap), &bitmap, sizeof(bitmap)) ;
+	return bitmap.crc == crc8(bitmap.bits, sizeof(bitmap.bits)) ;
+};
+
+// writeBit: sets the bitmap bit of a slot and the CRC of its block (only writes if the bit changes), keeps the free
+// count and the lowest free slot. Taking the lowest free slot looks for the next one: worst case Capacity/ 64 reads,
+// amortized O(1) over a fill
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeBit(uint16_t index, bool used){
+	bitmapBlock_t bitmap ;
+	uint16_t block = index / (8 * BITMAPBLOCK) ;
+	uint8_t byte = (index / 8) % BITMAPBLOCK, mask = 1 << (index & 7) ;
+	readBitmap(block, bitmap) ;
+	if (((bitmap.bits[byte] & mask) != 0) == used)
+		return ;
+	bitmap.bits[byte] = used ? bitmap.bits[byte] | mask : bitmap.bits[byte] & ~mask ;
+	bitmap.crc = crc8(bitmap.bits, sizeof(bitmap.bits)) ;
+	_storage.write(bitmapAddr + block * sizeof(bitmap) + byte, &bitmap.bits[byte], 1) ;
+	_storage.write(bitmapAddr + block * sizeof(bitmap) + sizeof(bitmap.bits), &bitmap.crc, 1) ;
+	if (used){
+		_freeCount-- ;
+		if (index == _firstFree)
+			_firstFree = _freeCount ? nextFree(index + 1) : Capacity ;
+	} else {
+		_freeCount++ ;
+		if (index < _firstFree)
+			_firstFree = index ;
+	}
+};
+
+// readVersion: version of the card (with pending journal entries)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint16_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::readVersion(uint16_t index){
+	int8_t entry = findJournal(index) ;
+	if (entry >= 0)
+		return _journal[entry].version ;
+	uint16_t version ;
+	_storage.read(versionAddr + (index / VERSIONBLOCK) * sizeof(versionBlock_t) + (index % VERSIONBLOCK) * sizeof(uint16_t), &version, sizeof(version)) ;
+	return version ;
+};
+
+// readVersions: reads a block of the version table, false if its CRC is bad
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::readVersions(uint16_t block, versionBlock_t &versions){
+	_storage.read(versionAddr + block * sizeof(versions), &versions, sizeof(versions)) ;
+	return versions.crc == crc8(versions.version, sizeof(versions.version)) ;
+};
+
+// writeVersion: writes the version of a card and the CRC of its block
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::writeVersion(uint16_t index, uint16_t version){
+	versionBlock_t versions ;
+	uint32_t addr = versionAddr + (index / VERSIONBLOCK) * sizeof(versions) ;
+	readVersions(index / VERSIONBLOCK, versions) ;
+	versions.version[index % VERSIONBLOCK] = version ;
+	versions.crc = crc8(versions.version, sizeof(versions.version)) ;
+	_storage.write(addr + (index % VERSIONBLOCK) * sizeof(uint16_t), &version, sizeof(version)) ;
+	_storage.write(addr + sizeof(versions.version), &versions.crc, 1) ;
+};
+
+// nextVersion: version for a change. Versions only increase, so a wrap would make the changes look older than
+// the controller's. At 0xFFFF all cards get version 1 instead (one write of the version table per 65535 changes):
+// the generation changes, so the next exportSince() of the controller is a full resync
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+uint16_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::nextVersion(){
+	if (_version == 0xFFFF){
+		if (_journalCount)
+			flushJournal() ;
+		newGeneration() ;
+		resetVersions(1) ;
+	}
+	return ++_version ;
+};
+
+// resetVersions: sets all card versions and the database version, invalidates the journal (entries hold versions)
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::resetVersions(uint16_t version){
+	if (JournalSize){
+		journalEntry_t entry ;
+		memset(&entry, 0xFF, sizeof(entry)) ;			// card index 0xFFFF is never valid
+		for (uint8_t i=0 ; i < JournalSize ; i++){
+			_storage.write(journalAddr + i * sizeof(entry), &entry, sizeof(entry)) ;
+		}
+		_journalTail = 0 ;
+	}
+	versionBlock_t versions ;
+	for (uint16_t b=0 ; b < versionBlocks ; b++){
+		for (uint8_t j=0 ; j < VERSIONBLOCK ; j++)
+			versions.version[j] = b * VERSIONBLOCK + j < Capacity ? version : 0 ;
+		versions.crc = crc8(versions.version, sizeof(versions.version)) ;
+		_storage.write(versionAddr + b * sizeof(versions), &versions, sizeof(versions)) ;
+	}
+	_version = version ;
+};
+
+// findJournal: newest pending journal entry for the card, -1 if none
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int8_t CardDBT<Storage, Capacity, JournalSize, BloomBits>::findJournal(uint16_t index){
+	for (int8_t i = _journalCount - 1 ; i >= 0 ; i--){
+		if (_journal[i].cardIndex == index)
+			return i ;
+	}
+	return -1 ;
+};
+
+// readJournal: reads the entry in a slot of the ring, false if it is not valid
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+bool CardDBT<Storage, Capacity, JournalSize, BloomBits>::readJournal(uint8_t slot, journalEntry_t &entry){
+	_storage.read(journalAddr + slot * sizeof(entry), &entry, sizeof(entry)) ;
+	return entry.seq % JournalSize == slot && entry.cardIndex < Capacity && entry.cardType <= delCard &&
+			entry.crc == crc8(&entry, sizeof(entry) - 1) ;
+};
+
+// loadJournal: the newest entry is the one not followed by its successor in the ring. Going back from there,
+// entries are pending up to the first one that is not newer than the version of its card (entries are applied in
+// order and wrote the version table). An entry of a corrupt version block counts as pending. The pending entries
+// are loaded and replayed in order
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::loadJournal(){
+	journalEntry_t entry, next ;
+	uint8_t head = 0, pending = 0 ;						// sequence after the newest entry, entries to load
+	for (uint8_t i=0 ; i < JournalSize ; i++){
+		if (readJournal(i, entry) && (!readJournal((i + 1) % JournalSize, next) || next.seq != (uint8_t)(entry.seq + 1))){
+			head = entry.seq + 1 ;
+			break ;
+		}
+	}
+	for (uint8_t n=1 ; n <= JournalSize ; n++){
+		uint8_t seq = head - n ;
+		if (!readJournal(seq % JournalSize, entry) || entry.seq != seq)
+			break ;
+		if (entry.version > _version) _version = entry.version ;
+		versionBlock_t versions ;						// a corrupt version block cannot tell: pending
+		if (readVersions(entry.cardIndex / VERSIONBLOCK, versions) && entry.version <= versions.version[entry.cardIndex % VERSIONBLOCK])
+			break ;										// applied, and so are the older entries
+		pending = n ;
+	}
+	_journalTail = head - pending ;
+	_journalCount = _journalApplied = 0 ;
+	while (_journalCount < pending){
+		readJournal((uint8_t)(_journalTail + _journalCount) % JournalSize, _journal[_journalCount]) ;
+		_journalCount++ ;
+	}
+};
+
+// appendJournal: writes a journal entry, compacts first if the journal is full
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::appendJournal(uint16_t index, cardTypes_t cardType, uint16_t version){
+	if (_journalCount == JournalSize)
+		flushJournal() ;
+	journalEntry_t &entry = _journal[_journalCount] ;
+	entry.seq = _journalTail + _journalCount ;
+	entry.cardIndex = index ;
+	entry.cardType = cardType ;
+	entry.version = version ;
+	entry.crc = crc8(&entry, sizeof(entry) - 1) ;
+	_storage.write(journalAddr + (entry.seq % JournalSize) * sizeof(entry), &entry, sizeof(entry)) ;
+	_journalCount++ ;
+};
+
+// applyJournal: writes type and version of a journal entry to its record (if not overruled by a later entry),
+// a record with a bad CRC is emptied instead of patched
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::applyJournal(uint8_t entry){
+	for (uint8_t i = entry + 1 ; i < _journalCount ; i++){
+		if (_journal[i].cardIndex == _journal[entry].cardIndex)
+			return ;									// later entry for the same card
+	}
+	uint16_t index = _journal[entry].cardIndex ;
+	recordType_t stored ;								// only the type changes
+	_storage.read(recordAddr(index), &stored, sizeof(stored)) ;
+	if (stored.cardCrc == recordCrc(stored)){
+		stored.cardType = _journal[entry].cardType ;
+	} else {											// corrupt record, the card is unknown: empty it
+		memset(&stored, 0, sizeof(stored)) ;
+		_cache.set(index, stored) ;
+	}
+	storeRecord(index, stored) ;
+	writeVersion(index, _journal[entry].version) ;
+	writeBit(index, slotUsed(stored.cardType)) ;
+};
+
+// flushJournal: applies all pending entries, the applied entries stay in the ring until they are overwritten
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+void CardDBT<Storage, Capacity, JournalSize, BloomBits>::flushJournal(){
+	while (_journalApplied < _journalCount)
+		applyJournal(_journalApplied++) ;
+	_journalTail += _journalCount ;
+	_journalCount = _journalApplied = 0 ;
+};
+
+// scanStorage: block scan for cardKey, returns the card Index or maxCards
+template <class Storage, uint16_t Capacity, uint8_t JournalSize, uint16_t BloomBits>
+int CardDBT<Storage, Capacity, JournalSize, BloomBits>::scanStorage(uint64_t cardKey){
+	recordType_t block[SCANRECORDS] ;
+	for (uint16_t i=0 ; i < Capacity ; i += SCANRECORDS){
+		uint8_t n = Capacity - i < SCANRECORDS ? Capacity - i : SCANRECORDS ;
+		_storage.read(recordAddr(i), block, n * sizeof(recordType_t)) ;
+		for (uint8_t j=0 ; j < n ; j++){
+			block[j].cardType = overlayType(i + j, block[j].cardType) ;
+			if (block[j].cardType != noCard && block[j].cardID == cardKey)
+				return i + j ;
+		}
+	}
+	return maxCards ;
+};
+#endif
@@ -0,0 +1,309 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+By AWI () 2016
+ Storage backends for the CardDB card database
+
+ PROJECT: MySensors / Multisensor
+ PROGRAMMER: AWI
+ DATE: October 16, 2026/ last update: October 16, 2026
+ FILE: CardDBStorage.cpp
+ LICENSE: Public domain
+
+Change log:
+20261016 - created
+20261016 - bus backends left out of host builds (CARDDB_HOST)
+20261016 - SPIFlashStorage: scratch sectors in turn, rewrite log and recovery in begin()
+*/
+
+#include "CardDBStorage.h"
+#ifdef __AVR__
+#include <avr/eeprom.h>
+#else
+#include <EEPROM.h>
+#endif
+#ifndef CARDDB_HOST					// host builds (tests/) have no I2C and SPI buses
+#include <Wire.h>
+#include <SPI.h>
+#endif
+
+#define I2C_CHUNK 30			// max data bytes per Wire transaction (32 byte buffer - 2 address bytes)
+#define FLASH_SECTOR 4096UL		// erase sector size of the flash
+#define FLASH_PAGE 256			// program page size of the flash
+#define FLASH_CHUNK 32			// copy buffer size for sector rewrites
+#define FLASH_LOG (FLASH_SECTOR / 8)	// rewrite log entries in the log sector
+#define LOG_PENDING 0x0F		// log entry states (programmed in this order, bits only cleared)
+#define LOG_DONE 0x00
+
+// flash commands
+#define FLASH_READ 0x03
+#define FLASH_PROGRAM 0x02
+#define FLASH_WREN 0x06
+#define FLASH_STATUS 0x05
+#define FLASH_ERASE4K 0x20
+#define FLASH_RELEASE 0xAB
+
+//** EEPROMStorage **//
+EEPROMStorage::EEPROMStorage(uint16_t base){
+	_base = base ;
+}
+
+void EEPROMStorage::read(uint32_t addr, void *buf, uint16_t len){
+#ifdef __AVR__
+	eeprom_read_block(buf, (const void *)(_base + (uint16_t)addr), len) ;
+#else
+	for (uint16_t i=0 ; i < len ; i++){
+		((uint8_t *)buf)[i] = EEPROM.read(_base + addr + i) ;
+	}
+#endif
+}
+
+void EEPROMStorage::write(uint32_t addr, const void *buf, uint16_t len){
+#ifdef __AVR__
+	eeprom_update_block(buf, (void *)(_base + (uint16_t)addr), len) ;	// only writes bytes that changed
+#else
+	for (uint16_t i=0 ; i < len ; i++){
+		EEPROM.write(_base + addr + i, ((const uint8_t *)buf)[i]) ;
+	}
+#endif
+}
+
+#ifndef CARDDB_HOST
+//** I2CEEPROMStorage **//
+I2CEEPROMStorage::I2CEEPROMStorage(uint8_t device, uint8_t pageSize, uint16_t base, bool fram){
+	_device = device ;
+	_pageSize = pageSize ;
+	_base = base ;
+	_fram = fram ;
+}
+
+void I2CEEPROMStorage::begin(){
+	Wire.begin() ;
+}
+
+void I2CEEPROMStorage::read(uint32_t addr, void *buf, uint16_t len){
+	uint8_t *data = (uint8_t *)buf ;
+	addr += _base ;
+	while (len){
+		uint8_t n = len > I2C_CHUNK ? I2C_CHUNK : len ;
+		Wire.beginTransmission(_device) ;
+		Wire.write((uint8_t)(addr >> 8)) ;
+		Wire.write((uint8_t)addr) ;
+		Wire.endTransmission() ;
+		Wire.requestFrom(_device, n) ;
+		for (uint8_t i=0 ; i < n ; i++){
+			data[i] = Wire.read() ;
+		}
+		addr += n ; data += n ; len -= n ;
+	}
+}
+
+void I2CEEPROMStorage::write(uint32_t addr, const void *buf, uint16_t len){
+	const uint8_t *data = (const uint8_t *)buf ;
+	addr += _base ;
+	while (len){
+		uint16_t n = _pageSize - (addr % _pageSize) ;		// never cross a page boundary
+		if (n > I2C_CHUNK) n = I2C_CHUNK ;
+		if (n > len) n = len ;
+		Wire.beginTransmission(_device) ;
+		Wire.write((uint8_t)(addr >> 8)) ;
+		Wire.write((uint8_t)addr) ;
+		Wire.write(data, n) ;
+		Wire.endTransmission() ;
+		if (!_fram) waitReady() ;
+		addr += n ; data += n ; len -= n ;
+	}
+}
+
+void I2CEEPROMStorage::waitReady(){
+	for (uint8_t i=0 ; i < 100 ; i++){				// max 10ms
+		Wire.beginTransmission(_device) ;
+		if (Wire.endTransmission() == 0) return ;	// device acknowledges when write cycle is done
+		delayMicroseconds(100) ;
+	}
+}
+
+//** SPIFlashStorage **//
+SPIFlashStorage::SPIFlashStorage(uint8_t csPin, uint32_t base, uint32_t scratch){
+	_csPin = csPin ;
+	_base = base ;
+	_scratch = scratch ;
+	_logPos = 0 ;
+}
+
+void SPIFlashStorage::begin(){
+	pinMode(_csPin, OUTPUT) ;
+	digitalWrite(_csPin, HIGH) ;
+	SPI.begin() ;
+	command(FLASH_RELEASE, 0) ;						// wake up from power down
+	digitalWrite(_csPin, HIGH) ;
+	SPI.endTransaction() ;
+	delayMicroseconds(5) ;							// release time
+	recover() ;
+}
+
+void SPIFlashStorage::read(uint32_t addr, void *buf, uint16_t len){
+	readAbs(_base + addr, buf, len) ;
+}
+
+void SPIFlashStorage::write(uint32_t addr, const void *buf, uint16_t len){
+	const uint8_t *data = (const uint8_t *)buf ;
+	addr += _base ;
+	while (len){
+		uint32_t sector = addr & ~(FLASH_SECTOR - 1) ;
+		uint16_t n = sector + FLASH_SECTOR - addr ;		// part in this sector
+		if (n > len) n = len ;
+		if (programmable(addr, data, n)){
+			program(addr, data, n) ;
+		} else {
+			rewriteSector(sector, addr, data, n) ;
+		}
+		addr += n ; data += n ; len -= n ;
+	}
+}
+
+void SPIFlashStorage::readAbs(uint32_t addr, void *buf, uint16_t len){
+	command(FLASH_READ, addr) ;
+	for (uint16_t i=0 ; i < len ; i++){
+		((uint8_t *)buf)[i] = SPI.transfer(0) ;
+	}
+	digitalWrite(_csPin, HIGH) ;
+	SPI.endTransaction() ;
+}
+
+void SPIFlashStorage::program(uint32_t addr, const uint8_t *data, uint16_t len){
+	while (len){
+		uint16_t n = FLASH_PAGE - (addr % FLASH_PAGE) ;	// never cross a page boundary
+		if (n > len) n = len ;
+		command(FLASH_WREN, 0) ;
+		digitalWrite(_csPin, HIGH) ;
+		SPI.endTransaction() ;
+		command(FLASH_PROGRAM, addr) ;
+		for (uint16_t i=0 ; i < n ; i++){
+			SPI.transfer(data[i]) ;
+		}
+		digitalWrite(_csPin, HIGH) ;
+		SPI.endTransaction() ;
+		waitReady() ;
+		addr += n ; data += n ; len -= n ;
+	}
+}
+
+void SPIFlashStorage::eraseSector(uint32_t sector){
+	command(FLASH_WREN, 0) ;
+	digitalWrite(_csPin, HIGH) ;
+	SPI.endTransaction() ;
+	command(FLASH_ERASE4K, sector) ;
+	digitalWrite(_csPin, HIGH) ;
+	SPI.endTransaction() ;
+	waitReady() ;
+}
+
+bool SPIFlashStorage::programmable(uint32_t addr, const uint8_t *data, uint16_t len){
+	uint8_t chunk[FLASH_CHUNK] ;
+	while (len){
+		uint8_t n = len > FLASH_CHUNK ? FLASH_CHUNK : len ;
+		readAbs(addr, chunk, n) ;
+		for (uint8_t i=0 ; i < n ; i++){
+			if ((chunk[i] & data[i]) != data[i]) return false ;	// 0 -> 1 needs an erase
+		}
+		addr += n ; data += n ; len -= n ;
+	}
+	return true ;
+}
+
+// rewriteSector: a power failure before the log entry leaves the sector as it was, after it begin() copies back
+void SPIFlashStorage::rewriteSector(uint32_t sector, uint32_t addr, const uint8_t *data, uint16_t len){
+	if (_logPos == FLASH_LOG){						// log full, all entries done
+		eraseSector(_scratch) ;
+		_logPos = 0 ;
+	}
+	rewriteLog_t entry = { sector, (uint8_t)(_logPos % FLASH_SCRATCH), 0, 0xFF, LOG_PENDING } ;
+	entry.check = logCheck(entry) ;
+	uint32_t scratch = _scratch + (1 + entry.scratch) * FLASH_SECTOR ;
+	uint32_t logAddr = _scratch + _logPos * sizeof(entry) ;
+	eraseSector(scratch) ;
+	copySector(sector, scratch, addr, data, len) ;
+	program(logAddr, (const uint8_t *)&entry, sizeof(entry)) ;	// the copy is complete
+	_logPos++ ;
+	eraseSector(sector) ;
+	copySector(scratch, sector, 0, 0, 0) ;
+	entry.state = LOG_DONE ;
+	program(logAddr + sizeof(entry) - 1, &entry.state, 1) ;
+}
+
+void SPIFlashStorage::copySector(uint32_t from, uint32_t to, uint32_t addr, const uint8_t *data, uint16_t len){
+	uint8_t chunk[FLASH_CHUNK] ;
+	for (uint32_t pos=0 ; pos < FLASH_SECTOR ; pos += FLASH_CHUNK){
+		readAbs(from + pos, chunk, FLASH_CHUNK) ;
+		uint8_t blank = 0xFF ;
+		for (uint8_t i=0 ; i < FLASH_CHUNK ; i++){
+			uint32_t a = from + pos + i ;
+			if (a >= addr && a < addr + len) chunk[i] = data[a - addr] ;
+			blank &= chunk[i] ;
+		}
+		if (blank != 0xFF) program(to + pos, chunk, FLASH_CHUNK) ;
+	}
+}
+
+uint8_t SPIFlashStorage::logCheck(const rewriteLog_t &entry){
+	uint8_t sum = entry.scratch ;
+	for (uint8_t i=0 ; i < 32 ; i += 8) sum += (uint8_t)(entry.sector >> i) ;
+	return ~sum ;
+}
+
+// recover: the log ends at the first blank entry. Only the last entry can be pending (rewrites are sequential and
+// recovered at boot), copying it back again is harmless
+void SPIFlashStorage::recover(){
+	rewriteLog_t entry, last ;
+	bool found = false ;
+	for (_logPos = 0 ; _logPos < FLASH_LOG ; _logPos++){
+		readAbs(_scratch + _logPos * sizeof(entry), &entry, sizeof(entry)) ;
+		uint8_t blank = 0xFF ;
+		for (uint8_t i=0 ; i < sizeof(entry) ; i++) blank &= ((uint8_t *)&entry)[i] ;
+		if (blank == 0xFF) break ;
+		last = entry ;
+		found = true ;
+	}
+	if (!found || last.state != LOG_PENDING || last.check != logCheck(last) || last.scratch >= FLASH_SCRATCH)
+		return ;									// nothing pending, or a partly written entry (sector untouched)
+	eraseSector(last.sector) ;
+	copySector(_scratch + (1 + last.scratch) * FLASH_SECTOR, last.sector, 0, 0, 0) ;
+	last.state = LOG_DONE ;
+	program(_scratch + (_logPos - 1) * sizeof(last) + sizeof(last) - 1, &last.state, 1) ;
+}
+
+// command: selects the chip and sends command + 24 bit address (caller deselects)
+void SPIFlashStorage::command(uint8_t cmd, uint32_t addr){
+	SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0)) ;
+	digitalWrite(_csPin, LOW) ;
+	SPI.transfer(cmd) ;
+	if (cmd == FLASH_READ || cmd == FLASH_PROGRAM || cmd == FLASH_ERASE4K){
+		SPI.transfer((uint8_t)(addr >> 16)) ;
+		SPI.transfer((uint8_t)(addr >> 8)) ;
+		SPI.transfer((uint8_t)addr) ;
+	}
+}
+
+void SPIFlashStorage::waitReady(){
+	command(FLASH_STATUS, 0) ;
+	while (SPI.transfer(0) & 0x01) ;				// busy bit
+	digitalWrite(_csPin, HIGH) ;
+	SPI.endTransaction() ;
+}
+#endif
@@ -0,0 +1,194 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+By AWI () 2016
+ Storage backends for the CardDB card database
+
+ PROJECT: MySensors / Multisensor
+ PROGRAMMER: AWI
+ DATE: October 16, 2026/ last update: October 16, 2026
+ FILE: CardDBStorage.h
+ LICENSE: Public domain
+
+Summary:
+	Each backend offers the same block interface, addresses are relative to the start of the store:
+		void begin() ;											// initialise the hardware
+		void read(uint32_t addr, void *buf, uint16_t len) ;		// block read
+		void write(uint32_t addr, const void *buf, uint16_t len) ;	// block write (backend takes care of pages)
+
+	EEPROMStorage		internal EEPROM (block functions, unchanged bytes are not rewritten)
+	I2CEEPROMStorage	external 24LCxx EEPROM or FRAM on I2C (page writes, 16 bit addressing)
+	SPIFlashStorage		SPI NOR flash (W25Qxx), sector rewrite through scratch sectors (in turn) if bits need to be set
+	MemoryStorage		RAM store (volatile, for testing on the host)
+	CountingStorage		wraps a backend and counts reads, writes, changed bytes and the modelled write time
+
+Remarks:
+	Host builds (tests/) define CARDDB_HOST: I2CEEPROMStorage and SPIFlashStorage are not compiled
+	SPIFlashStorage: the rewrite area (scratch) is a log sector and FLASH_SCRATCH scratch sectors. A rewrite copies the
+		sector with the new data to the next scratch sector, appends an entry to the log, erases the sector, copies
+		back and marks the entry done. begin() finishes a rewrite that was interrupted after its copy was complete.
+		Nearly every CardDB change sets bits (type, version, bitmap), so a change costs two 4KB erases: a scratch
+		sector wears at 1/FLASH_SCRATCH of the rewrites, the log sector is erased once per FLASH_SECTOR/8 rewrites.
+		A power failure while the full log is erased could leave an entry that looks pending (unlikely), prefer
+		EEPROM or FRAM for databases that change often
+
+Change log:
+20261016 - created
+20261016 - CountingStorage
+20261016 - host builds (CARDDB_HOST)
+20261016 - CountingStorage counts changed bytes only
+20261016 - SPIFlashStorage rotates the scratch sectors, rewrite log recovered by begin()
+*/
+
+#ifndef CardDBStorage_h
+#define CardDBStorage_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+#include <inttypes.h>
+
+#define EEPROM_Start 0x1A0	// >= MySensors eeprom EEPROM_LOCAL_CONFIG_ADDRESS
+#define FLASH_SCRATCH 4		// scratch sectors of SPIFlashStorage, used in turn for sector rewrites
+
+// internal EEPROM
+class EEPROMStorage
+{
+public:
+	EEPROMStorage(uint16_t base = EEPROM_Start) ;
+	void begin() {} ;
+	void read(uint32_t addr, void *buf, uint16_t len) ;
+	void write(uint32_t addr, const void *buf, uint16_t len) ;
+private:
+	uint16_t _base ;								// first EEPROM address of the store
+};
+
+// external I2C EEPROM (24LCxx) or FRAM
+class I2CEEPROMStorage
+{
+public:
+	// device: I2C address, pageSize: write page of the device, fram: no write cycle time (no ack polling)
+	I2CEEPROMStorage(uint8_t device = 0x50, uint8_t pageSize = 32, uint16_t base = 0, bool fram = false) ;
+	void begin() ;
+	void read(uint32_t addr, void *buf, uint16_t len) ;
+	void write(uint32_t addr, const void *buf, uint16_t len) ;
+private:
+	uint8_t _device, _pageSize ;
+	uint16_t _base ;
+	bool _fram ;
+	// waitReady: ack polling until the write cycle of the EEPROM is finished
+	void waitReady() ;
+};
+
+// SPI NOR flash (W25Qxx and compatibles)
+class SPIFlashStorage
+{
+public:
+	// csPin: chip select, base: first address of the store, scratch: rewrite area (outside the store), log sector
+	// followed by FLASH_SCRATCH scratch sectors
+	SPIFlashStorage(uint8_t csPin, uint32_t base = 0, uint32_t scratch = 0x1000) ;
+	// begin: wakes up the flash and finishes an interrupted sector rewrite
+	void begin() ;
+	void read(uint32_t addr, void *buf, uint16_t len) ;
+	void write(uint32_t addr, const void *buf, uint16_t len) ;
+private:
+	typedef struct {
+		uint32_t sector ;							// sector being rewritten
+		uint8_t scratch ;							// scratch sector with its new content
+		uint8_t check ;								// ~sum of sector and scratch
+		uint8_t reserved ;
+		uint8_t state ;								// LOG_PENDING: copy complete, LOG_DONE: copied back
+		} __attribute__((packed)) rewriteLog_t ;	// 8 bytes, appended to the log sector
+	uint8_t _csPin ;
+	uint32_t _base, _scratch ;
+	uint16_t _logPos ;								// entries in the log sector
+	// logCheck: check byte of a log entry (a blank or partly written entry does not pass)
+	static uint8_t logCheck(const rewriteLog_t &entry) ;
+	// recover: finds the end of the log, copies back a pending rewrite
+	void recover() ;
+	// copySector: copies a sector into an erased one, len bytes at addr replaced by data, erased chunks skipped
+	void copySector(uint32_t from, uint32_t to, uint32_t addr, const uint8_t *data, uint16_t len) ;
+	void readAbs(uint32_t addr, void *buf, uint16_t len) ;
+	// program: programs bytes (only clears bits), takes care of page boundaries
+	void program(uint32_t addr, const uint8_t *data, uint16_t len) ;
+	void eraseSector(uint32_t sector) ;
+	// programmable: true if data can be written without erase (no 0 -> 1 bits)
+	bool programmable(uint32_t addr, const uint8_t *data, uint16_t len) ;
+	// rewriteSector: copy sector to the next scratch sector with new data, log it, erase and copy back
+	void rewriteSector(uint32_t sector, uint32_t addr, const uint8_t *data, uint16_t len) ;
+	void command(uint8_t cmd, uint32_t addr) ;
+	void waitReady() ;
+};
+
+// RAM store, starts blank (0xFF) like erased EEPROM
+template <uint16_t Size>
+class MemoryStorage
+{
+public:
+	MemoryStorage() { memset(_mem, 0xFF, Size) ; } ;
+	void begin() {} ;
+	void read(uint32_t addr, void *buf, uint16_t len) { memcpy(buf, _mem + addr, len) ; } ;
+	void write(uint32_t addr, const void *buf, uint16_t len) { memcpy(_mem + addr, buf, len) ; } ;
+	uint8_t *data() { return _mem ; } ;			// direct access to the store
+private:
+	uint8_t _mem[Size] ;
+};
+
+// counts the traffic to a backend, write time modelled per byte (EEPROM ~3.3ms).
+// Only bytes that change are counted as written (eeprom_update_block skips the others)
+template <class Backend>
+class CountingStorage
+{
+public:
+	CountingStorage(Backend &backend, uint16_t writeMicros = 3300) : _backend(backend), _writeMicros(writeMicros) { reset() ; } ;
+	void begin() { _backend.begin() ; } ;
+	void read(uint32_t addr, void *buf, uint16_t len) { reads++ ; readBytes += len ; _backend.read(addr, buf, len) ; } ;
+	void write(uint32_t addr, const void *buf, uint16_t len) { writes++ ; writeBytes += changed(addr, (const uint8_t *)buf, len) ; _backend.write(addr, buf, len) ; } ;
+	// reset: clears the counters
+	void reset() { reads = writes = 0 ; readBytes = writeBytes = 0 ; } ;
+	// writeTime: modelled write time in us
+	uint32_t writeTime() { return writeBytes * _writeMicros ; } ;
+	// print: prints the counters (reads/ bytes, writes/ changed bytes, write time)
+	void print(Print &out = Serial) {
+		out.print("reads ") ; out.print(reads) ; out.print("/") ; out.print(readBytes) ;
+		out.print("B writes ") ; out.print(writes) ; out.print("/") ; out.print(writeBytes) ;
+		out.print("B ") ; out.print(writeTime() / 1000) ; out.println("ms") ;
+	} ;
+	uint16_t reads, writes ;						// calls
+	uint32_t readBytes, writeBytes ;				// bytes read, bytes changed by writes
+private:
+	Backend &_backend ;
+	uint16_t _writeMicros ;
+	// changed: bytes of buf that differ from the store (compare reads are not counted)
+	uint16_t changed(uint32_t addr, const uint8_t *data, uint16_t len) {
+		uint8_t old[16] ;
+		uint16_t count = 0 ;
+		for (uint16_t i=0 ; i < len ; i += sizeof(old)){
+			uint16_t left = len - i ;
+			uint8_t n = left < sizeof(old) ? left : sizeof(old) ;
+			_backend.read(addr + i, old, n) ;
+			for (uint8_t j=0 ; j < n ; j++){
+				if (old[j] != data[i + j]) count++ ;
+			}
+		}
+		return count ;
+	} ;
+};
+#endif
@@ -38,19 +38,67 @@
 
 //FINITE State
 FState::FState( void (*updateFunction)() ){
+	init();
 	userEnter = 0;
 	userUpdate = updateFunction;
 	userExit = 0;
+	timeout = 0;
+	timeoutState = this;
 }
 
 FState::FState( void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)() ){
+	init();
 	userEnter = enterFunction;
 	userUpdate = updateFunction;
 	userExit = exitFunction;
+	timeout = 0;
+	timeoutState = this;
+}
+
+FState::FState( void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)(), unsigned long timeout, FState& timeoutState ){
+	init();
+	userEnter = enterFunction;
+	userUpdate = updateFunction;
+	userExit = exitFunction;
+	this->timeout = timeout;
+	this->timeoutState = &timeoutState;
+}
+
+FState::FState( FState& parent, void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)() ){
+	init();
+	userEnter = enterFunction;
+	userUpdate = updateFunction;
+	userExit = exitFunction;
+	timeout = 0;
+	timeoutState = this;
+	this->parent = &parent;
+}
+
+//give the state the next id, no statistics yet
+void FState::init(){
+	static uint8_t lastId = 0;
+	id = ++lastId;
+	parent = 0;
+	clearStats();
+}
+
+bool FState::isIn( const FState& state ) const {
+	for (const FState* s = this; s; s = s->parent) {
+		if (s == &state) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void FState::clearStats(){
+	entries = 0;
+	dwell = 0;
 }
 
 //what to do when entering this state
 void FState::enter(){
+	entries++;
 	if (userEnter){
 		userEnter();
 	}
@@ -73,18 +121,23 @@ void FState::exit(){
 
 
 //FINITE STATE MACHINE
-FiniteStateMachine::FiniteStateMachine(FState& current){
+FiniteStateMachine::FiniteStateMachine(FState& current) : timeoutTimer(timeoutExpired, this) {
 	needToTriggerEnter = true;
 	currentState = nextState = &current;
-	stateChangeTime = 0;
+	timer = 0;
+	stateChangeTime = enterTime = 0;
+	traceHead = traceCount = 0;
 }
 
 FiniteStateMachine& FiniteStateMachine::update() {
 	//simulate a transition to the first state
 	//this only happens the first time update is called
 	if (needToTriggerEnter) { 
+		enterParents(currentState->parent, 0);
 		currentState->enter();
 		needToTriggerEnter = false;
+		stateChangeTime = enterTime = millis();
+		startTimer();
 	} else {
 		if (currentState != nextState){
 			immediateTransitionTo(*nextState);
@@ -101,13 +154,95 @@ FiniteStateMachine& FiniteStateMachine::transitionTo(FState& state){
 }
 
 FiniteStateMachine& FiniteStateMachine::immediateTransitionTo(FState& state){
+	unsigned long now = millis();
 	currentState->exit();
+	for (FState* s = currentState->parent; s && !state.isIn(*s); s = s->parent) {
+		s->exit();		//parents that are left, innermost first
+	}
+	for (FState* s = currentState; s; s = s->parent) {
+		s->dwell += now - enterTime;		//the parents were in the state as long as the substate
+	}
+	FTrace& entry = trace[traceHead];
+	entry.from = currentState->id;
+	entry.to = state.id;
+	entry.time = now;
+	traceHead = (traceHead + 1) % FSM_TRACE;
+	if (traceCount < FSM_TRACE) {
+		traceCount++;
+	}
+	enterParents(state.parent, currentState);
 	currentState = nextState = &state;
 	currentState->enter();
-	stateChangeTime = millis();
+	stateChangeTime = enterTime = now;
+	startTimer();
 	return *this;
 }
 
+//enter the parents of a new state that do not contain from (0 = all), outermost first
+void FiniteStateMachine::enterParents( FState* state, const FState* from ){
+	if (state && !(from && from->isIn(*state))) {
+		enterParents(state->parent, from);
+		state->enter();
+	}
+}
+
+//the nearest state with a timeout, timed from entering the current state
+void FiniteStateMachine::startTimer(){
+	for (timer = currentState; timer && !timer->timeout; timer = timer->parent);
+	if (timer) {
+		timeoutTimer.start(timer->timeout);
+	} else {
+		timeoutTimer.stop();
+	}
+}
+
+//timeout of the current state or a parent (from timerWheel.update), unless a transition is already pending
+void FiniteStateMachine::timeoutExpired( void* machine ){
+	FiniteStateMachine& fsm = *(FiniteStateMachine*)machine;
+	if (fsm.timer && fsm.currentState == fsm.nextState) {
+		fsm.nextState = fsm.timer->timeoutState;
+	}
+}
+
+//find the row for the event: rows of the current state, then of its parents, then rows for any state (0)
+//returns false if the event is not handled. Only state and event are read from flash until a row matches
+bool FiniteStateMachine::dispatchTable( uint8_t event, const FTransition* table, uint8_t rows ){
+	FTransition row;
+	for (FState* level = currentState; ; level = level->parent) {
+		for (uint8_t i = 0; i < rows; i++) {
+			if ((FState*)pgm_read_ptr(&table[i].state) != level || pgm_read_byte(&table[i].event) != event) {
+				continue;
+			}
+			memcpy_P(&row, &table[i], sizeof(row));
+			if (row.guard && !row.guard()) {
+				continue;
+			}
+			if (row.action) {
+				row.action();
+			}
+			if (row.next) {
+				transitionTo(*row.next);
+			}
+			return true;
+		}
+		if (!level) {
+			break;
+		}
+	}
+	return false;
+}
+
+//ms until the next transition or timeout
+unsigned long FiniteStateMachine::timeToDeadline(){
+	if (needToTriggerEnter || currentState != nextState) {
+		return 0;
+	}
+	if (!timer) {
+		return FSM_NO_DEADLINE;
+	}
+	return timeoutTimer.remaining();
+}
+
 //return the current state
 FState& FiniteStateMachine::getCurrentState() {
 	return *currentState;
@@ -1,27 +1,72 @@
 //#ifndef FiniteStateMachine_h
 //#define FiniteStateMachine_h
 
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
 #include <inttypes.h>
+#include "TimerWheel.h"		//state timeouts, needs timerWheel.update() in the loop
 
 //define the functionality of the states
 class FState {
 	public:
 		FState( void (*updateFunction)() );
 		FState( void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)() );
+		//state with a timeout: after timeout ms in the state the machine goes to timeoutState
+		FState( void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)(), unsigned long timeout, FState& timeoutState );
+		//substate of parent: events and the timeout not handled by the state are handled by the parent
+		FState( FState& parent, void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)() );
 		//FState( byte newId, void (*enterFunction)(), void (*updateFunction)(), void (*exitFunction)() );
 		
-		//void getId();
+		uint8_t getId() const { return id; }				//1.. in order of construction
+		uint16_t getEntries() const { return entries; }		//times entered
+		unsigned long getDwell() const { return dwell; }	//ms spent in the state or its substates (until the last transition)
+		void clearStats();
+		bool isIn( const FState& state ) const;				//state is this state or one of its parents
 		void enter();
 		void update();
 		void exit();
 	private:
-		//byte id;
+		void init();
+		uint8_t id;
+		uint16_t entries;
+		unsigned long dwell;
 		void (*userEnter)();
 		void (*userUpdate)();
 		void (*userExit)();
+		unsigned long timeout;		//0 = no timeout (timeout of the parent)
+		FState* timeoutState;
+		FState* parent;
+		
+		friend class FiniteStateMachine;
+};
+
+#define FSM_NO_DEADLINE 0xFFFFFFFFUL
+
+#ifndef FSM_TRACE
+#define FSM_TRACE 8		//transitions kept in the trace (6 bytes RAM each)
+#endif
+
+//trace entry: state ids and millis() of the transition
+struct FTrace {
+	uint8_t from;
+	uint8_t to;
+	unsigned long time;
 };
 
 
+//transition table row (table in PROGMEM): in state (0 = any state) on event, if guard (0 = always):
+//call action (0 = none) and go to next (0 = stay in the state)
+struct FTransition {
+	FState* state;
+	uint8_t event;
+	bool (*guard)();
+	void (*action)();
+	FState* next;
+};
+
 //define the finite state machine functionality
 class FiniteStateMachine {
 	public:
@@ -31,14 +76,41 @@ class FiniteStateMachine {
 		FiniteStateMachine& transitionTo( FState& state );
 		FiniteStateMachine& immediateTransitionTo( FState& state );
 		
+		//dispatch an event through a transition table, the first matching row wins. Event 0 (no event) returns at once
+		template <uint8_t Rows>
+		FiniteStateMachine& dispatch( uint8_t event, const FTransition (&table)[Rows] ) {
+			if (event) {
+				dispatchTable(event, table, Rows);
+			}
+			return *this;
+		}
+		
 		FState& getCurrentState();
-		bool isInState( FState &state ) const;
+		bool isInState( FState &state ) const;		//the current state itself, not its parents
 		
 		unsigned long timeInCurrentState();
+		//ms until the machine has something to do: 0 = transition or timeout due, FSM_NO_DEADLINE = only events
+		unsigned long timeToDeadline();
+		
+		//transition trace, i = 0 is the oldest transition
+		uint8_t traceLength() const { return traceCount; }
+		const FTrace& getTrace( uint8_t i ) const { return trace[(traceHead + FSM_TRACE - traceCount + i) % FSM_TRACE]; }
+		void clearTrace() { traceCount = 0; }
 		
 	private:
+		bool dispatchTable( uint8_t event, const FTransition* table, uint8_t rows );
+		void enterParents( FState* state, const FState* from );
+		void startTimer();
+		static void timeoutExpired( void* machine );
+		
 		bool 	needToTriggerEnter;
 		FState* 	currentState;
 		FState* 	nextState;
-		unsigned long stateChangeTime;
+		FState* 	timer;		//state with the timeout for the current state (0 = none)
+		WheelTimer	timeoutTimer;
+		unsigned long stateChangeTime;		//millis() of the last transitionTo or transition (timeInCurrentState)
+		unsigned long enterTime;		//millis() the current state was entered (dwell time)
+		FTrace	trace[FSM_TRACE];
+		uint8_t	traceHead;		//next entry to write
+		uint8_t	traceCount;
 };
@@ -28,6 +28,45 @@ By AWI () 2015
 #endif
 #include "LedFlash.h"
 
+#ifdef __AVR__
+// keeps the timer interrupt out while a setter changes the led (LedFlashGroup::startTimer)
+class LedFlashAtomic {
+public:
+  LedFlashAtomic() { _sreg = SREG ; cli() ; }
+  ~LedFlashAtomic() { SREG = _sreg ; }
+private:
+  uint8_t _sreg ;
+};
+#define LF_ATOMIC LedFlashAtomic atomic
+#else
+#define LF_ATOMIC
+#endif
+
+static LedFlashGroup *timerGroup = 0 ;		// group updated from the timer interrupt
+
+#define LF_PWM 0xFE							// _written: pin driven by PWM
+
+// gamma 2.2 at linear brightness 0, 8, 16 .. 256, interpolated in between
+static const uint8_t gammaTable[33] PROGMEM = {0, 0, 1, 1, 3, 4, 6, 9, 12, 16, 20, 25, 30, 35, 42, 49,
+	56, 64, 73, 82, 91, 102, 113, 124, 137, 149, 163, 177, 192, 207, 223, 240, 255} ;
+
+static uint8_t gammaLevel(uint8_t level)
+{
+	if (level == 255){
+		return 255 ;
+	}
+	uint8_t low = pgm_read_byte(&gammaTable[level >> 3]) ;
+	uint8_t high = pgm_read_byte(&gammaTable[(level >> 3) + 1]) ;
+	return low + (((high - low) * (level & 7)) >> 3) ;
+}
+
+const uint8_t ledDoubleBlink[] PROGMEM = {LF_ON(100), LF_OFF(100), LF_ON(100), LF_OFF(500), LF_END} ;
+const uint8_t ledDenied[] PROGMEM = {LF_ON(80), LF_OFF(80), LF_ON(80), LF_OFF(80), LF_ON(80), LF_OFF(500), LF_END} ;
+const uint8_t ledDbFull[] PROGMEM = {LF_ON(400), LF_OFF(200), LF_ON(400), LF_OFF(200), LF_ON(400), LF_OFF(600), LF_END} ;
+const uint8_t ledSOS[] PROGMEM = {LF_ON(100), LF_OFF(100), LF_ON(100), LF_OFF(100), LF_ON(100), LF_OFF(300),
+	LF_ON(300), LF_OFF(100), LF_ON(300), LF_OFF(100), LF_ON(300), LF_OFF(300),
+	LF_ON(100), LF_OFF(100), LF_ON(100), LF_OFF(100), LF_ON(100), LF_OFF(700), LF_END} ;
+
   // Create an instance of LedFlash
   LedFlash::LedFlash(int pin, bool activeHigh, unsigned long flash_pulse, unsigned long flash_period ) {
 	_flash_freq = flash_period;				// default flash period (ms)
@@ -37,22 +76,37 @@ By AWI () 2015
 	_curState = LOW;
 	_flash_stat = F_OFF ;
 	_activeHigh = activeHigh ;
+	_flashTimer = _flashCounter = false ;
+	_level = _duty = 0 ;
 	pinMode(_pin, OUTPUT );
 	digitalWrite(_pin,_activeHigh ^ LOW);	// set Led to low
+	_written = _activeHigh ^ LOW ;
+#ifdef __AVR__
+	_port = portOutputRegister(digitalPinToPort(_pin)) ;
+	_mask = digitalPinToBitMask(_pin) ;
+#endif
 	_lastUpdate = millis();				// set timer value
 }
 
   // Attach to a pin and set initial state
   void LedFlash::attach(int pin) {
+	LF_ATOMIC ;
+	pwmDisconnect() ;					// old pin back to digital
 	_pin = pin;					// assign pin
 	_curState = LOW;
 	_flash_stat = F_OFF ;
 	digitalWrite(_pin, _activeHigh ^ LOW);	// set Led to low
+	_written = _activeHigh ^ LOW ;
+#ifdef __AVR__
+	_port = portOutputRegister(digitalPinToPort(_pin)) ;
+	_mask = digitalPinToBitMask(_pin) ;
+#endif
 	_lastUpdate = millis();				// set timer value
 	}
 
 	// Sets the led flash period
   void LedFlash::period(unsigned long flash_freq, unsigned long flashPulse) {
+	LF_ATOMIC ;
 	_flash_freq = flash_freq;
 	if (flashPulse == 0){
 		_flashPulse = flash_freq / 2 ; 				// if pulse width not specified then half period
@@ -64,17 +118,20 @@ By AWI () 2015
 
   // Sets the led to flash
   void LedFlash::flash(int duration) {
+	LF_ATOMIC ;
 	_flash_stat = F_FLASH;
 	_lastUpdate = millis();				// set timer value
 	_curState = HIGH;					// start with LED on (pulse)
 	if (duration != 0){
-		_flashTime = duration * 1000 + millis() ;  // set the timer values to milliseconds from now
+		_flashTime = millis() + duration * 1000UL ;  // deadline in milliseconds from now
 		_flashTimer = true ;
 	}
+	pwmDisconnect() ;
   }	
 
   // Sets the led to flash
   void LedFlash::count(int counts) {
+	LF_ATOMIC ;
 	_flash_stat = F_FLASH;
 	_lastUpdate = millis();				// set timer value
 	_curState = HIGH;					// start with LED on (pulse)
@@ -84,30 +141,36 @@ By AWI () 2015
 		_flashCounter = true ;
 		_flashTimer = false ;
 	}
+	pwmDisconnect() ;
   }	
 
   
   // Sets the led to on
   void LedFlash::on(int duration) {
+	LF_ATOMIC ;
 	_flash_stat = F_ON;
 	_curState = HIGH;
 	if (duration != 0){
-		_flashTime = duration * 1000 + millis() ;  // set the timer values to milliseconds from now
+		_flashTime = millis() + duration * 1000UL ;  // deadline in milliseconds from now
 		_flashTimer = true ;
 		_flashCounter = false ;
 	}
+	pwmDisconnect() ;
   }	
 
   // Sets the led to off
   void LedFlash::off(void) {
+	LF_ATOMIC ;
 	_flash_stat = F_OFF;
 	_curState = LOW;
 	_count = 0;
+	pwmDisconnect() ;
   }	
 
   // Sets the Led to perform current (or future) action for x seconds
   void LedFlash::timer(int Seconds){
-	_flashTime = Seconds * 1000 + millis() ;  // set the timer values to milliseconds from now
+	LF_ATOMIC ;
+	_flashTime = millis() + Seconds * 1000UL ;  // deadline in milliseconds from now
 	_flashTimer = true ;
 	_flashCounter = false ;
 	_count = 1; // Starts with at least 1 flash
@@ -115,6 +178,7 @@ By AWI () 2015
 
   // Sets the Led to perform current (or future) action for x counts
   void LedFlash::counter(int Counts){
+	LF_ATOMIC ;
 	_flashCount = Counts ;  				// set the counter to 
 	_flashCounter = true ;
 	_flashTimer = false ;
@@ -122,6 +186,122 @@ By AWI () 2015
   }
 
   
+  // Plays a pattern, the first step starts now
+  void LedFlash::play(const uint8_t *pattern, uint8_t repeat) {
+	LF_ATOMIC ;
+	_flash_stat = F_PATTERN ;
+	_flashTimer = _flashCounter = false ;	// the pattern ends itself
+	_pattern = pattern ;
+	_repeat = repeat ;
+	_step = pattern ;
+	_stepTime = 0 ;						// load the first step in update
+	_lastUpdate = millis() ;
+	pwmDisconnect() ;
+  }
+
+  // Fades from the current brightness
+  void LedFlash::fade(uint8_t level, unsigned int ms) {
+	LF_ATOMIC ;
+	uint8_t from = (_flash_stat == F_FADE || _flash_stat == F_BREATHE) ? _level : (_curState ? 255 : 0) ;
+	startFade(from, level, ms) ;
+	_flash_stat = F_FADE ;
+	pwmConnect() ;
+  }
+
+  // Breathes, starts dark
+  void LedFlash::breathe(unsigned int period, uint8_t level) {
+	LF_ATOMIC ;
+	startFade(0, level, period / 2) ;
+	_flash_stat = F_BREATHE ;
+	pwmConnect() ;
+  }
+
+  // One division per fade, update only multiplies
+  void LedFlash::startFade(uint8_t from, uint8_t to, unsigned int ms) {
+	_flashTimer = _flashCounter = false ;
+	_from = _level = from ;
+	_to = to ;
+	_fadeTime = ms ;
+	_fadeStep = ms ? (long)(to - from) * 256 / (long)ms : 0 ;	// 8.8 fixed point (no left shift of a negative)
+	_lastUpdate = millis() ;
+  }
+
+  // PWM on the pin's timer at the current brightness, called by the setters (not from the timer interrupt):
+  // connecting the output is a read-modify-write of the timer control register. The compare register is written
+  // as 255 - duty with the output inverted for an on high pin, so off is the top value: a constant level, no spike
+  void LedFlash::pwmConnect(void) {
+	_duty = gammaLevel(_level) ;
+#ifdef __AVR__
+	uint8_t ocr = 255 - _duty ;
+	uint8_t com = _activeHigh ? 2 : 3 ;		// COMx1:COMx0, 3 = inverted (on is a high pin)
+	_timer = digitalPinToTimer(_pin) ;
+	switch (_timer){
+#if defined(TCCR0A) && defined(COM0A1)
+	case TIMER0A: OCR0A = ocr ; TCCR0A = (TCCR0A & ~(3 << COM0A0)) | com << COM0A0 ; break ;
+#endif
+#if defined(TCCR0A) && defined(COM0B1)
+	case TIMER0B: OCR0B = ocr ; TCCR0A = (TCCR0A & ~(3 << COM0B0)) | com << COM0B0 ; break ;
+#endif
+#if defined(TCCR1A) && defined(COM1A1)
+	case TIMER1A: OCR1A = ocr ; TCCR1A = (TCCR1A & ~(3 << COM1A0)) | com << COM1A0 ; break ;
+#endif
+#if defined(TCCR1A) && defined(COM1B1)
+	case TIMER1B: OCR1B = ocr ; TCCR1A = (TCCR1A & ~(3 << COM1B0)) | com << COM1B0 ; break ;
+#endif
+#if defined(TCCR2A) && defined(COM2A1)
+	case TIMER2A: OCR2A = ocr ; TCCR2A = (TCCR2A & ~(3 << COM2A0)) | com << COM2A0 ; break ;
+#endif
+#if defined(TCCR2A) && defined(COM2B1)
+	case TIMER2B: OCR2B = ocr ; TCCR2A = (TCCR2A & ~(3 << COM2B0)) | com << COM2B0 ; break ;
+#endif
+	default:								// no PWM on the pin: the fade is on/ off
+		return ;
+	}
+#else
+	analogWrite(_pin, _activeHigh ? 255 - _duty : _duty) ;
+#endif
+	_written = LF_PWM ;
+  }
+
+  // Back to a digital output at the current state (digitalWrite disconnects the timer), called by the setters
+  void LedFlash::pwmDisconnect(void) {
+	if (_written == LF_PWM){
+		_written = _activeHigh ^ _curState ;
+		digitalWrite(_pin, _written) ;
+	}
+  }
+
+  // Brightness of a connected PWM output: only the compare register is written (no pinMode, no read-modify-write),
+  // safe in the timer interrupt. Compare registers are buffered by the timer, taken over at the end of the cycle
+  void LedFlash::pwmWrite(uint8_t duty) {
+	_duty = duty ;
+#ifdef __AVR__
+	uint8_t ocr = 255 - duty ;
+	switch (_timer){
+#if defined(TCCR0A) && defined(COM0A1)
+	case TIMER0A: OCR0A = ocr ; break ;
+#endif
+#if defined(TCCR0A) && defined(COM0B1)
+	case TIMER0B: OCR0B = ocr ; break ;
+#endif
+#if defined(TCCR1A) && defined(COM1A1)
+	case TIMER1A: OCR1A = ocr ; break ;
+#endif
+#if defined(TCCR1A) && defined(COM1B1)
+	case TIMER1B: OCR1B = ocr ; break ;
+#endif
+#if defined(TCCR2A) && defined(COM2A1)
+	case TIMER2A: OCR2A = ocr ; break ;
+#endif
+#if defined(TCCR2A) && defined(COM2B1)
+	case TIMER2B: OCR2B = ocr ; break ;
+#endif
+	}
+#else
+	analogWrite(_pin, _activeHigh ? 255 - duty : duty) ;
+#endif
+  }
+
   // returns the number of pulses from start of last flash
   unsigned int LedFlash::count(void){
 	  return _count;
@@ -130,6 +310,44 @@ By AWI () 2015
 	// Updates the led
 	// Returns true if On, false if Off
   bool LedFlash::update(void) {
+	uint8_t level = _activeHigh ^ tick() ;
+	if (_written == LF_PWM){				// fading, or faded out at the off level until a setter ends PWM
+		uint8_t duty = gammaLevel(_level) ;
+		if (duty != _duty){
+			pwmWrite(duty) ;
+		}
+	} else if (level != _written){		// only write changes
+		digitalWrite(_pin, level);
+		_written = level ;
+	}
+	return _curState;
+  }
+
+	// Next state of the led
+  bool LedFlash::tick(void) {
+	if (_flash_stat == F_FADE || _flash_stat == F_BREATHE){	// brightness on a line from _from to _to
+		unsigned long t = millis() - _lastUpdate ;
+		if (t >= _fadeTime && _flash_stat == F_BREATHE){		// turn around
+			uint8_t from = _from ;
+			_from = _to ;
+			_to = from ;
+			_fadeStep = -_fadeStep ;
+			_lastUpdate += _fadeTime ;
+			t -= _fadeTime ;
+			if (t > _fadeTime){					// late update, skip
+				t = _fadeTime ;
+			}
+		}
+		if (t >= _fadeTime){
+			_level = _to ;
+			if (_flash_stat == F_FADE && _to == 0){	// faded out
+				_flash_stat = F_OFF ;
+			}
+		} else {
+			_level = _from + (int)((_fadeStep * (long)t) >> 8) ;
+		}
+		_curState = _level ? HIGH : LOW ;
+	}
 	if (_flash_stat == F_FLASH){ 				// if flashing change state after xx millis
 		if (_curState == LOW){					// pause period 
 			if (millis()-_lastUpdate > _flashPause){
@@ -144,8 +362,28 @@ By AWI () 2015
 			}
 		}
 	}
-	if (_flashTimer){					// if timer is on check if expired
-		if (millis() > _flashTime){
+	if (_flash_stat == F_PATTERN){				// next step if the current step is over (one step per update)
+		if (millis() - _lastUpdate >= _stepTime){
+			uint8_t step = pgm_read_byte(_step) ;
+			if (step == LF_END){				// end of pattern: again or off
+				if (_repeat == 0 || --_repeat){
+					_step = _pattern ;
+					step = pgm_read_byte(_step) ;
+				} else {
+					_flash_stat = F_OFF ;
+					_curState = LOW ;
+				}
+			}
+			if (step != LF_END){
+				_step++ ;
+				_curState = step >> 7 ;
+				_lastUpdate += _stepTime ;		// no drift, steps follow each other
+				_stepTime = (step & 0x7F) * 10 ;
+			}
+		}
+	}
+	if (_flashTimer){					// if timer is on check if expired (wrap safe)
+		if (timerDue(millis(), _flashTime)){
 			_flashTimer = false ; 		// if expires switch off and reset Timer status
 			_flash_stat = F_OFF ;
 			_curState = LOW ;
@@ -159,7 +397,93 @@ By AWI () 2015
 		}
 
 	}
-	digitalWrite(_pin, _activeHigh ^ _curState);	// update led with current status
 	// Returns the updated pin state
 	return _curState;
+  }
+
+#ifdef __AVR__
+// Timer0 compare A fires once per Timer0 cycle (~1ms). A fade on pin 6 (OC0A) changes OCR0A from here (pwmWrite),
+// the new value is buffered until the Timer0 overflow (fast PWM): still one compare A per cycle, at the new duty.
+ISR(TIMER0_COMPA_vect)
+{
+	if (timerGroup){
+		timerGroup->update() ;
+	}
+}
+#endif
+
+  LedFlashGroup::LedFlashGroup() {
+	_count = 0 ;
+  }
+
+  bool LedFlashGroup::add(LedFlash &led) {
+	if (_count == LEDFLASH_GROUP){
+		return false ;
+	}
+	_leds[_count++] = &led ;
+	return true ;
+  }
+
+	// Updates the group from the Timer0 compare A interrupt (AVR only)
+  bool LedFlashGroup::startTimer(void) {
+#ifdef __AVR__
+	uint8_t oldSREG = SREG ;
+	cli() ;
+	timerGroup = this ;
+	TIMSK0 |= _BV(OCIE0A) ;
+	SREG = oldSREG ;
+	return true ;
+#else
+	return false ;
+#endif
+  }
+
+  void LedFlashGroup::stopTimer(void) {
+#ifdef __AVR__
+	TIMSK0 &= ~_BV(OCIE0A) ;
+#endif
+	timerGroup = 0 ;
+  }
+
+	// Collects the changed outputs per port, then writes each changed port once
+  void LedFlashGroup::update(void) {
+#ifdef __AVR__
+	volatile uint8_t *port[LEDFLASH_GROUP] ;
+	uint8_t set[LEDFLASH_GROUP], clear[LEDFLASH_GROUP] ;
+	uint8_t ports = 0 ;
+	for (uint8_t i = 0 ; i < _count ; i++){
+		LedFlash &led = *_leds[i] ;
+		if (led._written == LF_PWM){
+			led.update() ;							// PWM: compare register only, connected by the setters
+			continue ;
+		}
+		uint8_t level = led._activeHigh ^ led.tick() ;
+		if (level == led._written){
+			continue ;
+		}
+		led._written = level ;
+		uint8_t p = 0 ;
+		while (p < ports && port[p] != led._port) p++ ;
+		if (p == ports){						// first change on this port
+			port[ports] = led._port ;
+			set[ports] = clear[ports] = 0 ;
+			ports++ ;
+		}
+		if (level){
+			set[p] |= led._mask ;
+		} else {
+			clear[p] |= led._mask ;
+		}
+	}
+	for (uint8_t p = 0 ; p < ports ; p++){
+		uint8_t oldSREG = SREG ;				// read-modify-write, other pins of the port may change in interrupts
+		cli() ;
+		*port[p] = (*port[p] & ~clear[p]) | set[p] ;
+		SREG = oldSREG ;
+	}
+#else
+	for (uint8_t i = 0 ; i < _count ; i++){
+		_leds[i]->update() ;
+	}
+#endif
   }
\ No newline at end of file
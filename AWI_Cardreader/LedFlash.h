@@ -23,19 +23,61 @@ By AWI () 2015
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 /* assign an output to pin and perform actions
-on, off, flash, timer 
-update should be called as often as possible, only once per loop
-depends on millis() function, so avoid sleep...
+on, off, flash, timer, play (pattern)
+update should be called as often as possible, only once per loop (or by LedFlashGroup::startTimer)
+timing from millis() deadlines: sleep modes that keep Timer0 running (SLEEP_MODE_IDLE, as in the sketch) are fine,
+	deeper sleep stops millis() and the led
+on/ flash/ timer durations are deadlines checked by update (wrap safe timerDue of TimerWheel.h), so they also run
+	out when the group is updated from the timer interrupt
+fade, breathe: brightness on PWM pins through a gamma table, integer only (no division in update). The setters
+	connect the timer output (and the other setters end PWM), update only writes the compare register
+LedFlashGroup updates several LedFlash outputs, each port register is written once and only if an output changed
+	startTimer: the group is updated from the Timer0 compare A interrupt every ms (AVR), timing is independent of
+	the loop (blocking calls, EEPROM writes) and update is not called anymore. A fading led on pin 6 (OC0A) is
+	written into OCR0A from that interrupt: OCR0A is buffered in fast PWM (taken over at the Timer0 overflow), so
+	compare A still fires once per cycle, at the new duty. A faded out led stays in PWM at the off level (constant)
+	until the next setter
+
+patterns: run length steps in PROGMEM, one byte per step, 0 ends the pattern
+	LF_ON(ms) / LF_OFF(ms): output on/ off for ms (10ms resolution, 10..1270ms checked at compile time, repeat the
+	step for longer)
+	const uint8_t ledDenied[] PROGMEM = {LF_ON(100), LF_OFF(100), LF_ON(100), LF_OFF(100), LF_END} ;
 */
 
 #ifndef LedFlash_h
 #define LedFlash_h
 
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
 #include <inttypes.h>
+#include "TimerWheel.h"
 
 #define F_OFF  	0              // flash status values, local in class
 #define F_ON   	1
 #define F_FLASH 2
+#define F_PATTERN 3
+#define F_FADE 4
+#define F_BREATHE 5
+
+// pattern step time in 10ms, 10..1270ms checked at compile time (0 would end the pattern, more spills into bit 7)
+template <unsigned long ms> struct LedFlashStep {
+	static_assert(ms >= 10 && ms <= 1270, "LF_ON/ LF_OFF: step time 10..1270ms, repeat the step for longer") ;
+	static const uint8_t time = ms / 10 ;
+};
+#define LF_ON(ms)	(0x80 | LedFlashStep<(ms)>::time)	// pattern step: bit 7 = output, bit 0..6 = time in 10ms
+#define LF_OFF(ms)	(LedFlashStep<(ms)>::time)
+#define LF_END		0
+
+#define LEDFLASH_GROUP 4						// max outputs in a LedFlashGroup
+
+// standard patterns
+extern const uint8_t ledDoubleBlink[] PROGMEM ;	// ok/ accepted
+extern const uint8_t ledDenied[] PROGMEM ;		// three short: refused
+extern const uint8_t ledDbFull[] PROGMEM ;		// three long: database full
+extern const uint8_t ledSOS[] PROGMEM ;			// ... --- ...: error
 
 class LedFlash
 {
@@ -58,17 +100,59 @@ public:
   void timer(int Seconds) ;
 	// Sets the Led to perform current (or future) action for x counts
   void counter(int Counts) ;
+	// Plays a pattern (PROGMEM) repeat times (0 = until changed), then to off
+  void play(const uint8_t *pattern, uint8_t repeat = 1) ;
+	// Fades the led (PWM pin) from the current brightness to level (0..255) in ms, stays there (0 = off)
+  void fade(uint8_t level, unsigned int ms) ;
+	// Breathes the led (PWM pin) between off and level, period in ms (until changed)
+  void breathe(unsigned int period, uint8_t level = 255) ;
    // returns the number of pulses from start of last flash
   unsigned int count(void) ;
-	// Updates the led
+	// Updates the led (pin only written on change)
 	// Returns true if On, false if Off
   bool update(void);
 	
 protected:
+  friend class LedFlashGroup ;
+  // next state of the led, no output
+  bool tick(void) ;
+  uint8_t _written ;				// pin level last written (set by the constructor and attach), 0xFE = PWM
+  void startFade(uint8_t from, uint8_t to, unsigned int ms) ;
+  void pwmConnect(void) ;			// PWM on/ off (setters only, not from the timer interrupt)
+  void pwmDisconnect(void) ;
+  void pwmWrite(uint8_t duty) ;		// brightness, compare register only
+  uint8_t _from, _to, _level, _duty ;	// fade: linear brightness from, to and now, duty written (gamma)
+  unsigned int _fadeTime ;			// ms from _from to _to
+  long _fadeStep ;					// brightness per ms (8.8 fixed point)
+#ifdef __AVR__
+  volatile uint8_t *_port ;			// output register and bit of the pin (group writes)
+  uint8_t _mask ;
+  uint8_t _timer ;					// timer channel of the pin while in PWM (digitalPinToTimer)
+#endif
   unsigned long  _flash_freq, _flashPulse, _flashPause ; // frequency (=period), pulse and pause width in ms
-  unsigned long  _lastUpdate, _flashTime, _count, _flashCount ;  // period, counters ()
+  unsigned long  _lastUpdate, _flashTime, _count, _flashCount ;  // period, deadline of on/ flash (timer), counters ()
   uint8_t _curState, _flash_stat ; 
   bool _flashTimer, _flashCounter, _activeHigh ; // status flags
   uint8_t _pin;
+  const uint8_t *_pattern, *_step ;	// pattern (PROGMEM) and current step
+  uint16_t _stepTime ;				// ms of the current step
+  uint8_t _repeat ;					// plays left (0 = forever)
+};
+
+// updates a group of LedFlash outputs with one write per changed port
+class LedFlashGroup
+{
+public:
+  LedFlashGroup() ;
+	// Adds an output to the group (update the group, not the output), false if the group is full
+  bool add(LedFlash &led) ;
+	// Updates all outputs of the group
+  void update(void) ;
+	// Updates the group from the timer interrupt (one group), false if not supported
+  bool startTimer(void) ;
+  void stopTimer(void) ;
+private:
+  LedFlash *_leds[LEDFLASH_GROUP] ;
+  uint8_t _count ;
 };
 #endif
\ No newline at end of file
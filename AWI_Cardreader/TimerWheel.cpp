@@ -0,0 +1,200 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+By AWI () 2016
+ Cooperative timer wheel shared by the Cardreader libraries (LedFlash, FiniteStateMachine) and the sketch
+
+ PROJECT: MySensors / Multisensor
+ PROGRAMMER: AWI
+ DATE: October 16, 2026/ last update: October 16, 2026
+ FILE: TimerWheel.cpp
+ LICENSE: Public domain
+
+Change log:
+20261016 - created
+20261016 - stop() of a due timer keeps it in the due list (cancelled), start() from a callback after stop()
+*/
+
+#include "TimerWheel.h"
+
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+#define SLOT_MS (1UL << TIMERWHEEL_SHIFT)
+
+// time the slot of the deadline comes by (the timer runs out)
+static inline unsigned long slotTime(unsigned long deadline) { return (deadline + SLOT_MS - 1) & ~(SLOT_MS - 1) ; }
+
+TimerWheel timerWheel ;
+
+WheelTimer::WheelTimer(void (*callback)(void *arg), void *arg)
+{
+	_next = 0 ;
+	_deadline = _period = 0 ;
+	_callback = callback ;
+	_arg = arg ;
+	_slot = noSlot ;
+	_expired = false ;
+}
+
+void WheelTimer::start(unsigned long ms, unsigned long period)
+{
+	bool due = _slot == firing || _slot == restart || _slot == cancelled ;	// in the due list of update (from a callback)
+	if (_slot < TIMERWHEEL_SLOTS){
+		timerWheel.remove(*this) ;
+	}
+	_deadline = millis() + ms ;
+	_period = period ;
+	_expired = false ;
+	if (due){
+		_slot = restart ;									// added by update, the due list is linked through _next
+	} else {
+		timerWheel.add(*this) ;
+	}
+}
+
+void WheelTimer::stop()
+{
+	if (_slot < TIMERWHEEL_SLOTS){
+		timerWheel.remove(*this) ;
+	}
+	if (_slot == firing || _slot == restart){				// about to fire: stays in the due list, update skips it
+		_slot = cancelled ;
+	} else if (_slot != cancelled){
+		_slot = noSlot ;
+	}
+}
+
+bool WheelTimer::expired()
+{
+	bool result = _expired ;
+	_expired = false ;
+	return result ;
+}
+
+unsigned long WheelTimer::remaining() const
+{
+	if (!active()){
+		return TIMERWHEEL_NONE ;
+	}
+	unsigned long now = millis() ;
+	unsigned long runOut = slotTime(_deadline) ;
+	return timerDue(now, runOut) ? 0 : runOut - now ;
+}
+
+TimerWheel::TimerWheel()
+{
+	for (uint8_t i = 0 ; i < TIMERWHEEL_SLOTS ; i++){
+		_slots[i] = 0 ;
+	}
+	_last = 0 ;
+}
+
+// add: in the slot that starts at or after the deadline, so the timer is due when its slot comes by
+void TimerWheel::add(WheelTimer &timer)
+{
+	uint8_t slot = (slotTime(timer._deadline) >> TIMERWHEEL_SHIFT) & SLOT_MASK ;
+	if (timerDue(_last & ~(SLOT_MS - 1), timer._deadline)){	// slot already done: next slot
+		slot = ((_last >> TIMERWHEEL_SHIFT) + 1) & SLOT_MASK ;
+	}
+	timer._slot = slot ;
+	timer._next = _slots[slot] ;
+	_slots[slot] = &timer ;
+}
+
+void TimerWheel::remove(WheelTimer &timer)
+{
+	WheelTimer **link = &_slots[timer._slot] ;
+	while (*link && *link != &timer){
+		link = &(*link)->_next ;
+	}
+	if (*link){
+		*link = timer._next ;
+	}
+}
+
+void TimerWheel::update()
+{
+	unsigned long now = millis() ;
+	unsigned long ticks = (now >> TIMERWHEEL_SHIFT) - (_last >> TIMERWHEEL_SHIFT) ;	// slots passed
+	if (ticks == 0){
+		return ;
+	}
+	if (ticks > TIMERWHEEL_SLOTS){							// long time no update (or millis wrap), all slots once
+		ticks = TIMERWHEEL_SLOTS ;
+	}
+	uint8_t slot = (now >> TIMERWHEEL_SHIFT) - ticks ;
+	_last = now ;
+	WheelTimer *due = 0 ;									// due timers are collected first, callbacks may start timers
+	while (ticks--){
+		slot = (slot + 1) & SLOT_MASK ;
+		WheelTimer **link = &_slots[slot] ;
+		while (*link){
+			WheelTimer *timer = *link ;
+			if (timerDue(now, timer->_deadline)){			// due, else a later round of the wheel
+				*link = timer->_next ;
+				timer->_slot = WheelTimer::firing ;
+				timer->_next = due ;
+				due = timer ;
+			} else {
+				link = &timer->_next ;
+			}
+		}
+	}
+	while (due){
+		WheelTimer *timer = due ;
+		due = timer->_next ;
+		if (timer->_slot == WheelTimer::restart){			// started again by an earlier callback
+			add(*timer) ;
+			continue ;
+		}
+		if (timer->_slot == WheelTimer::cancelled){			// stopped by an earlier callback
+			timer->_slot = WheelTimer::noSlot ;
+			continue ;
+		}
+		timer->_slot = WheelTimer::noSlot ;
+		if (timer->_period){								// periodic: next deadline in phase, or from now if behind
+			timer->_deadline += timer->_period ;
+			if (timerDue(now, timer->_deadline)){
+				timer->_deadline = now + timer->_period ;
+			}
+			add(*timer) ;
+		}
+		if (timer->_callback){
+			timer->_callback(timer->_arg) ;
+		} else {
+			timer->_expired = true ;
+		}
+	}
+}
+
+unsigned long TimerWheel::nextDeadline() const
+{
+	unsigned long now = millis() ;
+	unsigned long next = TIMERWHEEL_NONE ;
+	for (uint8_t i = 0 ; i < TIMERWHEEL_SLOTS ; i++){
+		for (WheelTimer *timer = _slots[i] ; timer ; timer = timer->_next){
+			unsigned long runOut = slotTime(timer->_deadline) ;
+			if (timerDue(now, runOut)){
+				return 0 ;
+			}
+			if (runOut - now < next){
+				next = runOut - now ;
+			}
+		}
+	}
+	return next ;
+}
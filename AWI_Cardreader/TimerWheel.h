@@ -0,0 +1,105 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+By AWI () 2016
+ Cooperative timer wheel shared by the Cardreader libraries (LedFlash, FiniteStateMachine) and the sketch
+
+ PROJECT: MySensors / Multisensor
+ PROGRAMMER: AWI
+ DATE: October 16, 2026/ last update: October 16, 2026
+ FILE: TimerWheel.h
+ LICENSE: Public domain
+
+Summary:
+	WheelTimer: one shot or periodic timer, calls a callback or sets a flag (expired()) when it runs out.
+	The timers are kept in TIMERWHEEL_SLOTS lists by their deadline (hashed wheel, 2^TIMERWHEEL_SHIFT ms per slot):
+	start is O(1), update only looks at the slots that passed since the last update. Deadlines are compared
+	wrap safe, timers up to 24 days.
+	timerWheel.update() must be called in the loop (callbacks run from there), nextDeadline() gives the ms until
+	the next timer so the node can idle.
+
+Remarks:
+	Resolution is one slot (16ms): a timer runs out at its deadline or up to one slot later
+	Not for use in interrupts
+
+Change log:
+20261016 - created
+20261016 - stop() of a due timer keeps it in the due list (cancelled), start() from a callback after stop()
+*/
+
+#ifndef TimerWheel_h
+#define TimerWheel_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+#include <inttypes.h>
+
+#define TIMERWHEEL_SLOTS 16									// slots in the wheel (power of 2)
+#define TIMERWHEEL_SHIFT 4									// ms per slot = 2^shift
+#define TIMERWHEEL_NONE 0xFFFFFFFFUL						// nextDeadline: no timer running
+
+// wrap safe: true if deadline is reached at now
+inline bool timerDue(unsigned long now, unsigned long deadline) { return (long)(now - deadline) >= 0 ; }
+
+class WheelTimer
+{
+public:
+	// callback (with arg) when the timer runs out, without callback the timer sets expired()
+	WheelTimer(void (*callback)(void *arg) = 0, void *arg = 0) ;
+	// start: runs out after ms, then every period ms (0 = once)
+	void start(unsigned long ms, unsigned long period = 0) ;
+	void stop() ;
+	bool active() const { return _slot != noSlot && _slot != cancelled ; } ;
+	// expired: true once after the timer ran out (timers without callback)
+	bool expired() ;
+	// remaining: ms until the timer runs out (0 = due, TIMERWHEEL_NONE = not running)
+	unsigned long remaining() const ;
+private:
+	friend class TimerWheel ;
+	// not in a slot: stopped, in the due list of update (firing), started again or stopped by a callback before it
+	// fired (restart, cancelled: still linked in the due list, update adds or drops it)
+	static const uint8_t noSlot = 0xFF, firing = 0xFE, restart = 0xFD, cancelled = 0xFC ;
+	WheelTimer *_next ;
+	unsigned long _deadline, _period ;
+	void (*_callback)(void *arg) ;
+	void *_arg ;
+	uint8_t _slot ;											// list of the timer (noSlot = stopped)
+	bool _expired ;
+};
+
+class TimerWheel
+{
+public:
+	TimerWheel() ;
+	// update: runs out the timers of the slots passed since the last update
+	void update() ;
+	// nextDeadline: ms until the first timer runs out (0 = due, TIMERWHEEL_NONE = no timer)
+	unsigned long nextDeadline() const ;
+private:
+	friend class WheelTimer ;
+	void add(WheelTimer &timer) ;
+	void remove(WheelTimer &timer) ;
+	WheelTimer *_slots[TIMERWHEEL_SLOTS] ;
+	unsigned long _last ;									// millis() of the last update
+};
+
+extern TimerWheel timerWheel ;								// the wheel of the node
+#endif
@@ -1,108 +1,250 @@
 #include "Wiegand.h"
 
-volatile unsigned long WIEGAND::_cardTempHigh=0;
-volatile unsigned long WIEGAND::_cardTemp=0;
-volatile unsigned long WIEGAND::_lastWiegand=0;
-unsigned long WIEGAND::_code=0;
-volatile int WIEGAND::_bitCount=0;	
-int WIEGAND::_wiegandType=0;
+// supported card formats, masks and fields from the format descriptions (bit 1 = first bit received)
+const wiegandFormat_t wiegandFormats[] PROGMEM = {
+	// H10301 26 bit: even parity 1-13, odd parity 14-26, facility 2-9, card 10-25
+	{26, 0b010, 17, 8, 1, 16, {0x000003FFE000ULL, 0x000000001FFFULL, 0}},
+	// 34 bit: even parity 1-17, odd parity 18-34, facility 2-17, card 18-33
+	{34, 0b010, 17, 16, 1, 16, {0x0003FFFE0000ULL, 0x00000001FFFFULL, 0}},
+	// Corporate 1000 35 bit: even parity 2 over 3,4,6,7..33,34, odd parity 35 over 2,3,5,6..32,33,
+	// odd parity 1 over all, facility 3-14, card 15-34
+	{35, 0b110, 21, 12, 1, 20, {0x0003B6DB6DB6ULL, 0x00036DB6DB6DULL, 0x0007FFFFFFFFULL}},
+	// H10304 37 bit: even parity 1-19, odd parity 19-37, facility 2-17, card 18-36
+	{37, 0b010, 20, 16, 1, 19, {0x001FFFFC0000ULL, 0x00000007FFFFULL, 0}},
+	// Corporate 1000 48 bit: even parity 2 over 3,4,6,7..45,46, odd parity 48 over 2,3,5,6..44,45,47,
+	// odd parity 1 over all, facility 3-24, card 25-47
+	{48, 0b110, 24, 22, 1, 23, {0x76DB6DB6DB6CULL, 0x6DB6DB6DB6DBULL, 0xFFFFFFFFFFFFULL}},
+};
+
+// compiler barrier: the queue slots are not volatile, keep their accesses on their side of the index updates
+// (one core, no memory barrier instruction needed)
+#define QUEUE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+WIEGAND *WIEGAND::_readers[WIEGAND_READERS];
+uint8_t WIEGAND::_readerCount=0;
 
 WIEGAND::WIEGAND()
 {
+	_lastWiegand = 0;
+	_lastEdge = 0;
+	_cardTempHigh = 0;
+	_cardTemp = 0;
+	_bitCount = 0;
+	_event.code = 0;
+	_event.type = 0;
+	_event.time = 0;
+	_queueHead = 0;
+	_queueTail = 0;
+	memset(&_stats, 0, sizeof(_stats));		// no clearStats(): a global constructor must not enable interrupts
 }
 
-unsigned long WIEGAND::getCode()
+uint64_t WIEGAND::getCode()
 {
-	return _code;
+	return _event.code;
 }
 
 int WIEGAND::getWiegandType()
 {
-	return _wiegandType;
+	return _event.type;
 }
 
-bool WIEGAND::available()
+unsigned long WIEGAND::getTime()
+{
+	return _event.time;
+}
+
+// getStats, clearStats: the counters change in the ISR, interrupts are restored to their previous state (AVR)
+void WIEGAND::getStats(wiegandStats_t &stats)
+{
+#ifdef __AVR__
+	uint8_t oldSREG = SREG;
+	cli();
+	stats = _stats;
+	SREG = oldSREG;
+#else
+	noInterrupts();
+	stats = _stats;
+	interrupts();
+#endif
+}
+
+void WIEGAND::clearStats()
 {
-	bool ret;
-    noInterrupts();
-	ret=DoWiegandConversion();
+#ifdef __AVR__
+	uint8_t oldSREG = SREG;
+	cli();
+	memset(&_stats, 0, sizeof(_stats));
+	SREG = oldSREG;
+#else
+	noInterrupts();
+	memset(&_stats, 0, sizeof(_stats));
 	interrupts();
-	return ret;
+#endif
+}
+
+// available: takes the next decoded event from the queue (getCode, getWiegandType, getTime)
+bool WIEGAND::available()
+{
+	uint8_t tail = _queueTail;
+#ifndef __AVR__
+	if (tail == _queueHead && _bitCount)		// no frame timer, check if the frame being received is complete
+	{
+	    noInterrupts();
+		DoWiegandConversion(millis());
+		interrupts();
+	}
+#endif
+	if (tail == _queueHead)
+		return false;
+	QUEUE_BARRIER();							// slot read after the head that published it
+	_event = _queue[tail];						// copy before releasing the slot to the producer
+	QUEUE_BARRIER();
+	_queueTail = (tail + 1) & (WIEGAND_QUEUE - 1);
+	return true;
+}
+
+// PushEvent: producer side, the event is dropped if the consumer is WIEGAND_QUEUE events behind
+void WIEGAND::PushEvent (uint64_t code, unsigned long sysTick)
+{
+	uint8_t head = _queueHead;
+	uint8_t next = (head + 1) & (WIEGAND_QUEUE - 1);
+	if (next == _queueTail)
+	{
+		_stats.overflow++;
+		return;
+	}
+	_stats.frames++;
+	_queue[head].code = code;
+	_queue[head].type = _bitCount;
+	_queue[head].time = sysTick;
+	QUEUE_BARRIER();
+	_queueHead = next;							// publish after the event is written
 }
 
-void WIEGAND::begin()
+bool WIEGAND::begin()
 {
 #ifdef digitalPinToInterrupt
   // newer versions of Arduino provide pin to interrupt mapping
-  begin(2,digitalPinToInterrupt(2),3,digitalPinToInterrupt(3));
+  return begin(2,digitalPinToInterrupt(2),3,digitalPinToInterrupt(3));
 #else
-  begin(2,0,3,1);
+  return begin(2,0,3,1);
 #endif
 }
 
-void WIEGAND::begin(int pinD0, int pinIntD0, int pinD1, int pinIntD1)
+bool WIEGAND::begin(int pinD0, int pinIntD0, int pinD1, int pinIntD1)
 {
-	_lastWiegand = 0;
-	_cardTempHigh = 0;
-	_cardTemp = 0;
-	_code = 0;
-	_wiegandType = 0;
-	_bitCount = 0;  
+	static void (* const isrD0[])() = {ReadD0<0>, ReadD0<1>, ReadD0<2>, ReadD0<3>};
+	static void (* const isrD1[])() = {ReadD1<0>, ReadD1<1>, ReadD1<2>, ReadD1<3>};
+	uint8_t slot;
+	for (slot = 0; slot < _readerCount; slot++)		// begin() again on the same reader keeps its slot
+		if (_readers[slot] == this)
+			break;
+	if (slot == WIEGAND_READERS)
+		return false;
+	_readers[slot] = this;
+	if (slot == _readerCount)
+		_readerCount++;
 	pinMode(pinD0, INPUT);					// Set D0 pin as input
 	pinMode(pinD1, INPUT);					// Set D1 pin as input
-	attachInterrupt(pinIntD0, ReadD0, FALLING);	// Hardware interrupt - high to low pulse
-	attachInterrupt(pinIntD1, ReadD1, FALLING);	// Hardware interrupt - high to low pulse
+	attachInterrupt(pinIntD0, isrD0[slot], FALLING);	// Hardware interrupt - high to low pulse
+	attachInterrupt(pinIntD1, isrD1[slot], FALLING);	// Hardware interrupt - high to low pulse
+	return true;
 }
 
-void WIEGAND::ReadD0 ()
+#ifdef __AVR__
+// Timer0 compare B fires once per Timer0 cycle (~1ms) next to the millis() overflow, OCR0B is left alone.
+// It is only enabled while a frame is being received and completes the frame 25ms after its last bit.
+ISR(TIMER0_COMPB_vect)
 {
-	_bitCount++;				// Increament bit count for Interrupt connected to D0
-	if (_bitCount>31)			// If bit count more than 31, process high bits
-	{
-		_cardTempHigh |= ((0x80000000 & _cardTemp)>>31);	//	shift value to high bits
-		_cardTempHigh <<= 1;
-		_cardTemp <<=1;
-	}
-	else
+	WIEGAND::Tick();
+}
+#endif
+
+// Tick: completes the frames of all readers that are quiet for 25ms, stops the timer when no frame is pending
+void WIEGAND::Tick()
+{
+	bool pending = false;
+	for (uint8_t i = 0; i < _readerCount; i++)
 	{
-		_cardTemp <<= 1;		// D0 represent binary 0, so just left shift card data
+		WIEGAND *reader = _readers[i];
+		if (reader->_bitCount)
+		{
+			if (millis() - reader->_lastWiegand > 25)
+				reader->DoWiegandConversion(millis());
+			else
+				pending = true;
+		}
 	}
-	_lastWiegand = millis();	// Keep track of last wiegand bit received
+#ifdef __AVR__
+	if (!pending)
+		TIMSK0 &= ~_BV(OCIE0B);
+#else
+	(void)pending;								// no frame timer
+#endif
 }
 
-void WIEGAND::ReadD1()
+// Edge: shifts one bit in, called from the ISR of D0 (bit 0) or D1 (bit 1)
+void WIEGAND::Edge(uint8_t bit, unsigned long sysTick, unsigned long edgeTime)
 {
-	_bitCount ++;				// Increment bit count for Interrupt connected to D1
-	if (_bitCount>31)			// If bit count more than 31, process high bits
+	_stats.edges[bit]++;
+	if (_bitCount)
 	{
-		_cardTempHigh |= ((0x80000000 & _cardTemp)>>31);	// shift value to high bits
-		_cardTempHigh <<= 1;
-		_cardTemp |= 1;
-		_cardTemp <<=1;
+		if ((sysTick - _lastWiegand) > 25)			// bit after a 25ms gap starts a new frame, complete the
+			DoWiegandConversion(sysTick);			// previous one first so back to back frames are not merged
+		else
+		{
+			uint8_t bucket = 0;						// log2 bucket of the gap, max 7 shifts
+			for (unsigned long gap = (edgeTime - _lastEdge) >> 7; gap && bucket < 7; gap >>= 1)
+				bucket++;
+			_stats.gaps[bucket]++;
+		}
 	}
-	else
+	_lastEdge = edgeTime;
+	_cardTempHigh = (_cardTempHigh << 1) | (_cardTemp >> 31);	// 64 bit shift register, no branch on bit count
+	_cardTemp = (_cardTemp << 1) | bit;
+	_bitCount++;
+	_lastWiegand = sysTick;			// Keep track of last wiegand bit received
+#ifdef __AVR__
+	TIMSK0 |= _BV(OCIE0B);			// frame completion timer
+#endif
+}
+
+// GetFormat: copies the card format for the bit length from the table, false if not a supported card
+bool WIEGAND::GetFormat (uint8_t bitlength, wiegandFormat_t &format)
+{
+	for (uint8_t i = 0; i < sizeof(wiegandFormats) / sizeof(wiegandFormats[0]); i++)
 	{
-		_cardTemp |= 1;			// D1 represent binary 1, so OR card data with 1 then
-		_cardTemp <<= 1;		// left shift card data
+		memcpy_P(&format, &wiegandFormats[i], sizeof(format));
+		if (format.bits == bitlength)
+			return true;
 	}
-	_lastWiegand = millis();	// Keep track of last wiegand bit received
+	return false;
 }
 
-unsigned long WIEGAND::GetCardId (volatile unsigned long *codehigh, volatile unsigned long *codelow, char bitlength)
+// Parity: 1 if the number of ones in the masked frame is odd (xor fold to a nibble, 0x6996 is the nibble parity table)
+static uint8_t Parity (uint32_t high, uint32_t low, uint64_t mask)
 {
-	unsigned long cardID=0;
-
-	if (bitlength==26)								// EM tag
-		cardID = (*codelow & 0x1FFFFFE) >>1;
+	uint32_t v = (high & (uint32_t)(mask >> 32)) ^ (low & (uint32_t)mask);
+	v ^= v >> 16;
+	v ^= v >> 8;
+	v ^= v >> 4;
+	return (0x6996 >> (v & 0x0f)) & 1;
+}
 
-	if (bitlength==34)								// Mifare 
+// GetCardId: checks the parity and returns facility and card number (facility << card length | card)
+bool WIEGAND::GetCardId (const wiegandFormat_t &format, uint64_t &cardID)
+{
+	uint32_t high = _cardTempHigh, low = _cardTemp;
+	for (uint8_t i = 0; i < 3; i++)
 	{
-		*codehigh = *codehigh & 0x03;				// only need the 2 LSB of the codehigh
-		*codehigh <<= 30;							// shift 2 LSB to MSB		
-		*codelow >>=1;
-		cardID = *codehigh | *codelow;
+		if (format.parity[i] && Parity(high, low, format.parity[i]) != ((format.parityOdd >> i) & 1))
+			return false;
 	}
-	return cardID;
+	uint64_t frame = ((uint64_t)high << 32) | low;
+	uint64_t facility = (frame >> format.facilityPos) & (((uint64_t)1 << format.facilityLen) - 1);
+	uint64_t card = (frame >> format.cardPos) & (((uint64_t)1 << format.cardLen) - 1);
+	cardID = (facility << format.cardLen) | card;
+	return true;
 }
 
 char translateEnterEscapeKeyPress(char originalKeyPress) {
@@ -118,28 +260,27 @@ char translateEnterEscapeKeyPress(char originalKeyPress) {
     }
 }
 
-bool WIEGAND::DoWiegandConversion ()
+bool WIEGAND::DoWiegandConversion (unsigned long sysTick)
 {
-	unsigned long cardID;
-	unsigned long sysTick = millis();
+	uint64_t cardID;
+	wiegandFormat_t format;
 	
 	if ((sysTick - _lastWiegand) > 25)								// if no more signal coming through after 25ms
 	{
-		if ((_bitCount==26) || (_bitCount==34) || (_bitCount==8) || (_bitCount==4)) 	// bitCount for keypress=4 or 8, Wiegand 26=26, Wiegand 34=34
+		bool card = GetFormat(_bitCount, format);
+		if (card || (_bitCount==8) || (_bitCount==4)) 	// bitCount for keypress=4 or 8, cards from the format table
 		{
-			_cardTemp >>= 1;			// shift right 1 bit to get back the real value - interrupt done 1 left shift in advance
-			if (_bitCount>32)			// bit count more than 32 bits, shift high bits right to make adjustment
-				_cardTempHigh >>= 1;	
-
-			if((_bitCount==26) || (_bitCount==34))		// wiegand 26 or wiegand 34
+			if (card)
 			{
-				cardID = GetCardId (&_cardTempHigh, &_cardTemp, _bitCount);
-				_wiegandType=_bitCount;
+				bool valid = GetCardId (format, cardID);	// corrupted frames (parity) are dropped
+				if (valid)
+					PushEvent(cardID, _lastWiegand);
+				else
+					_stats.parity++;
 				_bitCount=0;
 				_cardTemp=0;
 				_cardTempHigh=0;
-				_code=cardID;
-				return true;				
+				return valid;				
 			}
 			else if (_bitCount==8)		// keypress wiegand with integrity
 			{
@@ -147,25 +288,21 @@ bool WIEGAND::DoWiegandConversion ()
 				// eg if key 1 pressed, data=E1 in binary 11100001 , high nibble=1110 , low nibble = 0001 
 				char highNibble = (_cardTemp & 0xf0) >>4;
 				char lowNibble = (_cardTemp & 0x0f);
-				_wiegandType=_bitCount;					
+				bool valid = (lowNibble == (~highNibble & 0x0f));	// check if low nibble matches the "NOT" of high nibble.
+				if (valid)										// a corrupted key press is dropped, the user presses again
+					PushEvent((int)translateEnterEscapeKeyPress(lowNibble), _lastWiegand);
+				else
+					_stats.parity++;
 				_bitCount=0;
 				_cardTemp=0;
 				_cardTempHigh=0;
-				
-				if (lowNibble == (~highNibble & 0x0f))		// check if low nibble matches the "NOT" of high nibble.
-                {
-                    _code = (int)translateEnterEscapeKeyPress(lowNibble);
-					return true;
-				}
-
-                // TODO: Handle validation failure case!
+				return valid;
 			}
             else if (4 == _bitCount) {
                 // 4-bit Wiegand codes have no data integrity check so we just
                 // read the LOW nibble.
-                _code = (int)translateEnterEscapeKeyPress(_cardTemp & 0x0000000F);
+                PushEvent((int)translateEnterEscapeKeyPress(_cardTemp & 0x0000000F), _lastWiegand);
 
-                _wiegandType = _bitCount;
                 _bitCount = 0;
                 _cardTemp = 0;
                 _cardTempHigh = 0;
@@ -175,7 +312,9 @@ bool WIEGAND::DoWiegandConversion ()
 		}
 		else
 		{
-			// well time over 25 ms and bitCount !=8 , !=26, !=34 , must be noise or nothing then.
+			// well time over 25 ms and bitCount not a key or card format, must be noise or nothing then.
+			if (_bitCount)
+				_stats.rejects[_bitCount < 56 ? _bitCount >> 3 : 7]++;
 			_lastWiegand=sysTick;
 			_bitCount=0;			
 			_cardTemp=0;
@@ -183,6 +322,55 @@ bool WIEGAND::DoWiegandConversion ()
 			return false;
 		}	
 	}
-	else
-		return false;
+	return false;
+}
+
+WiegandPin::WiegandPin(uint8_t length, unsigned long timeout)
+{
+	_length = length > 9 ? 9 : length;
+	_timeout = timeout;
+	clear();
+}
+
+void WiegandPin::clear()
+{
+	_digits = 0;
+	_pin = 0;
+}
+
+unsigned long WiegandPin::getPin()
+{
+	return _pin;
+}
+
+uint8_t WiegandPin::getDigits()
+{
+	return _digits;
+}
+
+WiegandPin::pinStatus_t WiegandPin::key(char key, unsigned long now)
+{
+	if (key == WIEGAND_ESCAPE)
+	{
+		clear();
+		return pinCancel;
+	}
+	if (key == WIEGAND_ENTER)
+		return _digits ? pinDone : pinIdle;
+	if ((uint8_t)key > 9 || _digits == 9)			// not a digit or no room for another one
+		return pinIdle;
+	_pin = _pin * 10 + key;
+	_digits++;
+	_lastKey = now;
+	return _digits == _length ? pinDone : pinDigit;
+}
+
+WiegandPin::pinStatus_t WiegandPin::update(unsigned long now)
+{
+	if (_digits && (now - _lastKey) > _timeout)
+	{
+		clear();
+		return pinTimeout;
+	}
+	return pinIdle;
 }
@@ -7,28 +7,103 @@
 #include "WProgram.h"
 #endif
 
+#define WIEGAND_QUEUE 4				// decoded events buffered between ISR and loop (power of 2)
+#define WIEGAND_READERS 2			// max readers per node, one pair of interrupts each (max 4, the ISR trampolines)
+									// an ATmega328p has two external interrupts (pins 2, 3): one reader
+#define WIEGAND_ENTER 0x0d			// keypad * key (4/ 8 bit key codes)
+#define WIEGAND_ESCAPE 0x1b			// keypad # key
+
+// card format, bit positions count from the last bit received (0)
+struct wiegandFormat_t {
+	uint8_t			bits;					// frame length
+	uint8_t			parityOdd;				// bit n set: parity check n is odd, else even
+	uint8_t			facilityPos, facilityLen;
+	uint8_t			cardPos, cardLen;
+	uint64_t		parity[3];				// bits covered by each check incl. the parity bit, 0 = unused
+};
+
+// decoded frame: card code (facility and card number, no parity) or key, bit length and time of the last bit
+struct wiegandEvent_t {
+	uint64_t		code;
+	int				type;
+	unsigned long	time;
+};
+
+// signal quality counters of a reader (wrap around), to diagnose cabling
+struct wiegandStats_t {
+	uint16_t		edges[2];				// falling edges on D0, D1
+	uint16_t		gaps[8];				// gaps between bits in a frame: < 128us << n, last bucket longer
+	uint16_t		frames;					// frames decoded (cards and keys)
+	uint16_t		rejects[8];				// frames with an unknown bit length, by length / 8 (last bucket 56+)
+	uint16_t		parity;					// parity (card) or complement (8 bit key) failures
+	uint16_t		overflow;				// events dropped, queue full
+};
+
+static_assert(WIEGAND_READERS >= 1 && WIEGAND_READERS <= 4, "WIEGAND_READERS: 1..4 readers, one ISR trampoline each");
+
+// one instance per reader, each reader needs two external interrupt pins (on an ATmega328p only one reader,
+// more readers need a board with more external interrupts, e.g. the ATmega2560 with six)
 class WIEGAND {
 
 public:
 	WIEGAND();
-	void begin();
-	void begin(int pinD0, int pinIntD0, int pinD1, int pinIntD1);
+	bool begin();
+	bool begin(int pinD0, int pinIntD0, int pinD1, int pinIntD1);	// false if all WIEGAND_READERS are in use
 	bool available();
-	unsigned long getCode();
+	uint64_t getCode();
 	int getWiegandType();
+	unsigned long getTime();
+	void getStats(wiegandStats_t &stats);		// consistent copy of the counters
+	void clearStats();
+	static void Tick();							// frame completion, called from the timer interrupt
 	
 private:
-	static void ReadD0();
-	static void ReadD1();
-	static bool DoWiegandConversion ();
-	static unsigned long GetCardId (volatile unsigned long *codehigh, volatile unsigned long *codelow, char bitlength);
+	// ISR trampolines: interrupts carry no context, slot N calls the instance registered in _readers[N]
+	// (all 4 are instantiated by begin(), the modulo keeps the unused ones inside _readers)
+	template <uint8_t N> static void ReadD0() { _readers[N % WIEGAND_READERS]->Edge(0, millis(), micros()); }
+	template <uint8_t N> static void ReadD1() { _readers[N % WIEGAND_READERS]->Edge(1, millis(), micros()); }
+	static WIEGAND			*_readers[WIEGAND_READERS];
+	static uint8_t			_readerCount;
+
+	void Edge(uint8_t bit, unsigned long sysTick, unsigned long edgeTime);
+	bool DoWiegandConversion (unsigned long sysTick);
+	void PushEvent (uint64_t code, unsigned long sysTick);
+	static bool GetFormat (uint8_t bitlength, wiegandFormat_t &format);
+	bool GetCardId (const wiegandFormat_t &format, uint64_t &cardID);
 	
-	static volatile unsigned long 	_cardTempHigh;
-	static volatile unsigned long 	_cardTemp;
-	static volatile unsigned long 	_lastWiegand;
-	static volatile int				_bitCount;	
-	static int				_wiegandType;
-	static unsigned long	_code;
+	volatile uint32_t		_cardTempHigh;						// 64 bit shift register in 32 bit halves (also on a host)
+	volatile uint32_t		_cardTemp;
+	volatile unsigned long 	_lastWiegand;
+	volatile unsigned long 	_lastEdge;							// micros() of the last bit (gap histogram)
+	volatile int			_bitCount;	
+	wiegandStats_t			_stats;
+	wiegandEvent_t			_event;								// current event (getCode, getWiegandType)
+	// single producer (frame completion) / single consumer (available) ring, each index written by one side only
+	wiegandEvent_t			_queue[WIEGAND_QUEUE];
+	volatile uint8_t		_queueHead;
+	volatile uint8_t		_queueTail;
+};
+
+// PIN entry from keypad keys: digits until ENTER or the PIN length, ESC or no key within the timeout clears
+class WiegandPin {
+
+public:
+	enum pinStatus_t : uint8_t {
+		pinIdle, pinDigit, pinDone, pinCancel, pinTimeout
+	};
+	WiegandPin(uint8_t length = 4, unsigned long timeout = 5000);	// length 0: only ENTER completes (max 9 digits)
+	pinStatus_t key(char key, unsigned long now);		// handles a key code, pinDone: getPin()/ getDigits() until clear()
+	pinStatus_t update(unsigned long now);				// pinTimeout (once) if a started PIN had no key within the timeout
+	void clear();
+	unsigned long getPin();
+	uint8_t getDigits();
+
+private:
+	uint8_t			_length;
+	uint8_t			_digits;
+	unsigned long	_pin;
+	unsigned long	_timeout;
+	unsigned long	_lastKey;
 };
 
 #endif
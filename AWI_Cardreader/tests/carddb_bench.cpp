@@ -0,0 +1,148 @@
+/*
+ CardDB storage traffic per operation on a counted RAM store, for database sizes and fill ratios:
+	lookup	swipe of an enrolled card (readCard + readCardTypeIdx)
+	miss	swipe of an unknown card
+	enroll	readCard (unknown) + writeCard
+	delete	deleteCard
+	boot	begin() (validation scan, journal replay)
+	compact	compact() (journal flush, purge, bitmap rebuild)
+	Bloom	false positive rate of the Bloom filter (full database, unknown cards) and its RAM
+	churn	4 cards deleted and included again in turn (setCardTypeIdx), bytes written and writes of the
+			hottest byte per operation (EEPROM cell wear)
+ Every operation is followed by db.update() as in the loop of the sketch, so journal compaction is included.
+ Per operation: storage reads/ bytes read and the bytes written that change (EEPROM update, ~3.3ms each).
+*/
+
+#include "CardDB.h"
+
+#define OPS 32
+
+static uint32_t cardKey(uint16_t i) { return (i * 2654435761UL) >> 8 | 1 ; }
+
+// report: reads and bytes read per op, bytes written per op (writes only), then clears the counters
+template <class Counter>
+static void report(Counter &counter, uint16_t ops, bool writes){
+	if (ops == 0){
+		printf(writes ? " %19s" : " %13s", "-") ;
+		return ;
+	}
+	printf(" %6.1f/%-6.0f", (double)counter.reads / ops, (double)counter.readBytes / ops) ;
+	if (writes)
+		printf(" %5.1f", (double)counter.writeBytes / ops) ;
+	counter.reset() ;
+}
+
+// counts the changed writes per byte of a RAM store (cell wear)
+template <uint16_t Size>
+class WearStorage : public MemoryStorage<Size>
+{
+public:
+	WearStorage() { memset(wear, 0, sizeof(wear)) ; } ;
+	void write(uint32_t addr, const void *buf, uint16_t len) {
+		for (uint16_t i=0 ; i < len ; i++){
+			if (this->data()[addr + i] != ((const uint8_t *)buf)[i]) wear[addr + i]++ ;
+		}
+		MemoryStorage<Size>::write(addr, buf, len) ;
+	} ;
+	uint16_t hottest() {
+		uint16_t max = 0 ;
+		for (uint16_t i=0 ; i < Size ; i++){
+			if (wear[i] > max) max = wear[i] ;
+		}
+		return max ;
+	} ;
+	uint16_t wear[Size] ;
+};
+
+template <uint16_t Capacity, uint8_t JournalSize>
+void bench(uint8_t fill){
+	typedef CardDBT<MemoryStorage<1>, Capacity, JournalSize> Layout ;
+	typedef WearStorage<Layout::storageSize> Store ;
+	static Store store ;
+	static Store blank ;
+	store = blank ;
+	CountingStorage<Store> counter(store) ;
+	CardDBT<CountingStorage<Store>, Capacity, JournalSize> db(counter) ;
+	db.begin() ;
+	printf("%5u %3u %3u%%", Capacity, JournalSize, fill) ;
+	uint16_t cards = (uint32_t)Capacity * fill / 100 ;
+	for (uint16_t i=0 ; i < cards ; i++)
+		db.writeCard(cardKey(i)) ;
+	db.compact() ;
+	counter.reset() ;
+	for (uint16_t i=0 ; i < OPS ; i++){
+		int idx = db.readCard(cardKey(i * 7919UL % cards)) ;
+		db.readCardTypeIdx(idx) ;
+		db.update() ;
+	}
+	report(counter, OPS, false) ;
+	for (uint16_t i=0 ; i < OPS ; i++){
+		db.readCard(cardKey(60000U - i)) ;
+		db.update() ;
+	}
+	report(counter, OPS, false) ;
+	uint16_t enrolled = 0 ;
+	for (uint16_t i=0 ; i < OPS && cards + i < Capacity ; i++){
+		if (db.readCard(cardKey(cards + i)) == Capacity)
+			db.writeCard(cardKey(cards + i)) ;
+		db.update() ;
+		enrolled++ ;
+	}
+	report(counter, enrolled, true) ;
+	for (uint16_t i=0 ; i < OPS ; i++){
+		db.deleteCard(cardKey(i * 7919UL % cards)) ;
+		db.update() ;
+	}
+	report(counter, OPS, true) ;
+	CardDBT<CountingStorage<Store>, Capacity, JournalSize> reboot(counter) ;
+	reboot.begin() ;
+	report(counter, 1, false) ;
+	reboot.compact() ;
+	report(counter, 1, true) ;
+	memset(store.wear, 0, sizeof(store.wear)) ;
+	for (uint16_t i=0 ; i < 4 * OPS ; i++){
+		reboot.setCardTypeIdx(i % 4, (i / 4) & 1 ? CardDBBase::idCard : CardDBBase::delCard) ;
+		reboot.update() ;
+	}
+	printf(" %5.1f %5.2f\n", (double)counter.writeBytes / (4 * OPS), (double)store.hottest() / (4 * OPS)) ;
+}
+
+// bloomRate: false positives of the Bloom filter of a full database
+template <uint16_t Capacity, uint16_t Bits = cardBloomBits(Capacity)>
+void bloomRate(){
+	static CardBloom<Capacity, Bits, true> bloom ;
+	bloom.clear() ;
+	for (uint16_t i=0 ; i < Capacity ; i++)
+		bloom.add(cardKey(i)) ;
+	uint16_t falsePositives = 0 ;
+	for (uint16_t i=0 ; i < 20000 ; i++)
+		falsePositives += bloom.mayContain(cardKey(30000U + i)) ;
+	printf("%5u %6u %5u %6.2f%%\n", Capacity, Bits, (unsigned)sizeof(bloom), falsePositives / 200.0) ;
+}
+
+template <uint16_t Capacity, uint8_t JournalSize>
+void benchFills(){
+	bench<Capacity, JournalSize>(25) ;
+	bench<Capacity, JournalSize>(50) ;
+	bench<Capacity, JournalSize>(90) ;
+}
+
+int main(){
+	printf("Bloom filter, full database\ncards   bits   RAM  false positives\n") ;
+	bloomRate<64>() ;
+	bloomRate<128>() ;
+	bloomRate<200>() ;
+	bloomRate<512>() ;
+	bloomRate<1000>() ;
+	bloomRate<512, 512 * BLOOMBITSPERCARD>() ;		// budget for the capacity
+	bloomRate<1000, 1000 * BLOOMBITSPERCARD>() ;
+	printf("\nper op: reads/bytes read, bytes written (changed)\n") ;
+	printf("cards jnl fill  lookup        miss          enroll              delete              boot          compact        churn wrB/hot\n") ;
+	benchFills<32, 0>() ;							// RAM copy (CACHEMAX), direct writes
+	benchFills<32, 8>() ;							// journal
+	benchFills<128, 0>() ;							// Bloom filter and storage scans
+	benchFills<512, 0>() ;
+	benchFills<512, 8>() ;
+	benchFills<1000, 0>() ;
+	return 0 ;
+}
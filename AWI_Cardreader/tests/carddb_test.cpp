@@ -0,0 +1,283 @@
+/*
+ CardDB on a RAM store: lookup, enroll, delete, journal replay across a reboot, compaction and repair,
+ for a cached (RAM copy) and an uncached (Bloom filter + storage scan) database
+*/
+
+#include <stddef.h>
+#include "CardDB.h"
+#include "test.h"
+
+// cardKey: spread out 24 bit card numbers
+static uint32_t cardKey(uint16_t i) { return (i * 2654435761UL) >> 8 | 1 ; }
+
+template <uint16_t Capacity, uint8_t JournalSize>
+void testDB(){
+	typedef CardDBT<MemoryStorage<1>, Capacity, JournalSize> Layout ;
+	typedef MemoryStorage<Layout::storageSize> Store ;
+	static Store store ;
+	CountingStorage<Store> counter(store) ;
+	{
+		CardDBT<CountingStorage<Store>, Capacity, JournalSize> db(counter) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbInit) ;				// blank store
+		for (uint16_t i=0 ; i < Capacity ; i++)
+			CHECK_EQ(db.writeCard(cardKey(i)), i) ;
+		CHECK_EQ(db.writeCard(cardKey(Capacity)), Capacity) ;		// full
+		for (uint16_t i=0 ; i < Capacity ; i++){
+			CHECK_EQ(db.readCard(cardKey(i)), i) ;
+			CHECK_EQ(db.readCardType(cardKey(i)), CardDBBase::idCard) ;
+		}
+		CHECK_EQ(db.readCard(12345), Capacity) ;					// unknown
+		CHECK_EQ(db.readCardTypeIdx(Capacity), CardDBBase::noCard) ;	// out of range: empty record, nothing written
+		CHECK_EQ(db.readCardIdIdx(-1), 0) ;
+		CHECK(!db.setCardTypeIdx(Capacity, CardDBBase::idCard)) ;
+		CHECK(!db.setCardRuleIdx(-1, 1)) ;
+		CHECK_EQ(db.deleteCard(cardKey(3)), 3) ;
+		CHECK_EQ(db.readCardTypeIdx(3), CardDBBase::delCard) ;
+		CHECK_EQ(db.writeCard(cardKey(Capacity)), 3) ;				// deleted slot is reused
+		CHECK(db.setCardTypeIdx(5, CardDBBase::masterCard)) ;
+		CHECK_EQ(db.deleteCard(cardKey(7)), 7) ;
+		counter.reset() ;
+		CHECK_EQ(db.readCard(cardKey(9)), 9) ;						// lookups never write
+		CHECK_EQ(counter.writes, 0) ;
+	}
+	{
+		CardDBT<CountingStorage<Store>, Capacity, JournalSize> db(counter) ;	// reboot, pending journal replayed
+		CHECK_EQ(db.begin(), CardDBBase::dbValid) ;
+		CHECK_EQ(db.readCard(cardKey(Capacity)), 3) ;
+		CHECK_EQ(db.readCardTypeIdx(5), CardDBBase::masterCard) ;
+		CHECK_EQ(db.readCardTypeIdx(7), CardDBBase::delCard) ;
+		CHECK_EQ(db.compact(), 1) ;
+		CHECK_EQ(db.readCardTypeIdx(7), CardDBBase::noCard) ;
+		CHECK_EQ(db.readCard(cardKey(7)), Capacity) ;
+	}
+	store.data()[Layout::recordsAddr + 2 * sizeof(CardDBBase::recordType_t)] ^= 0x55 ;	// corrupt record 2
+	{
+		CardDBT<CountingStorage<Store>, Capacity, JournalSize> db(counter) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbRepaired) ;
+		CHECK_EQ(db.readCardTypeIdx(2), CardDBBase::noCard) ;
+		CHECK_EQ(db.readCard(cardKey(4)), 4) ;
+	}
+}
+
+// versions never wrap: renumbering forces a full export for a controller that was up to date
+void testVersionWrap(){
+	typedef CardDBT<MemoryStorage<1>, 16, 8> Layout ;
+	static MemoryStorage<Layout::storageSize> store ;
+	CardDBT<MemoryStorage<Layout::storageSize>, 16, 8> db(store) ;
+	db.begin() ;
+	for (uint16_t i=0 ; i < 4 ; i++)
+		db.writeCard(cardKey(i)) ;
+	while (db.version() < 0xFFF0)
+		db.setCardTypeIdx(1, db.readCardTypeIdx(1) == CardDBBase::idCard ? CardDBBase::delCard : CardDBBase::idCard) ;
+	uint16_t since = db.version(), generation = db.generation(), cardIndex = 0 ;
+	uint8_t buf[16 * sizeof(CardDBBase::syncRecord_t)] ;
+	CHECK_EQ(db.exportSince(since, db.generation(), cardIndex, buf, sizeof(buf)), 0) ;	// controller up to date
+	for (uint8_t i=0 ; i < 32 ; i++)								// wraps
+		db.setCardTypeIdx(2, i & 1 ? CardDBBase::idCard : CardDBBase::delCard) ;
+	CHECK(db.version() < since) ;
+	CHECK(db.generation() != generation) ;
+	cardIndex = 0 ;
+	CHECK_EQ(db.exportSince(since, generation, cardIndex, buf, sizeof(buf)), 16 * sizeof(CardDBBase::syncRecord_t)) ;	// all cards
+	CardDBT<MemoryStorage<Layout::storageSize>, 16, 8> reboot(store) ;
+	CHECK_EQ(reboot.begin(), CardDBBase::dbValid) ;
+	CHECK_EQ(reboot.version(), db.version()) ;
+	CHECK_EQ(reboot.readCardTypeIdx(1), db.readCardTypeIdx(1)) ;
+	CHECK_EQ(reboot.readCardTypeIdx(2), CardDBBase::idCard) ;
+}
+
+// journal entries survive a compaction in the ring, a later direct write and a reboot
+void testJournal(){
+	typedef CardDBT<MemoryStorage<1>, 16, 4> Layout ;
+	typedef MemoryStorage<Layout::storageSize> Store ;
+	static Store store ;
+	{
+		CardDBT<Store, 16, 4> db(store) ;
+		db.begin() ;
+		for (uint16_t i=0 ; i < 10 ; i++)
+			db.writeCard(cardKey(i)) ;
+		db.deleteCard(cardKey(3)) ;
+		db.deleteCard(cardKey(4)) ;
+		db.compact() ;												// flushed, entries stay in the ring
+		CHECK_EQ(db.writeCard(cardKey(20)), 3) ;
+		db.setCardTypeIdx(5, CardDBBase::masterCard) ;				// pending
+	}
+	{
+		CardDBT<Store, 16, 4> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbValid) ;
+		CHECK_EQ(db.readCard(cardKey(20)), 3) ;
+		CHECK_EQ(db.readCardTypeIdx(4), CardDBBase::noCard) ;
+		CHECK_EQ(db.readCardTypeIdx(5), CardDBBase::masterCard) ;
+		for (uint8_t k=0 ; k < 9 ; k++)								// ring wraps
+			db.setCardTypeIdx(6, k & 1 ? CardDBBase::idCard : CardDBBase::delCard) ;
+	}
+	{
+		CardDBT<Store, 16, 4> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbValid) ;
+		CHECK_EQ(db.readCardTypeIdx(6), CardDBBase::delCard) ;
+		CHECK_EQ(db.readCardTypeIdx(5), CardDBBase::masterCard) ;
+	}
+}
+
+// corrupt version and bitmap blocks are detected, a corrupt record is not patched by the journal
+template <uint16_t Capacity, uint8_t JournalSize>
+void testCorruption(){
+	typedef CardDBT<MemoryStorage<1>, Capacity, JournalSize> Layout ;
+	typedef MemoryStorage<Layout::storageSize> Store ;
+	static Store store ;
+	uint8_t buf[16 * sizeof(CardDBBase::syncRecord_t)] ;
+	{
+		CardDBT<Store, Capacity, JournalSize> db(store) ;
+		db.begin() ;
+		for (uint16_t i=0 ; i < 12 ; i++)
+			db.writeCard(cardKey(i)) ;
+		db.deleteCard(cardKey(1)) ;
+	}
+	store.data()[Layout::versionAddr + 3] ^= 0x10 ;				// version of card 1
+	uint16_t since ;
+	{
+		CardDBT<Store, Capacity, JournalSize> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbRepaired) ;
+		CHECK_EQ(db.readCardTypeIdx(1), CardDBBase::delCard) ;		// journal applied before renumbering
+		since = db.version() - 1 ;
+		uint16_t cardIndex = 0 ;
+		CHECK_EQ(db.exportSince(since, db.generation(), cardIndex, buf, sizeof(buf)), 16 * sizeof(CardDBBase::syncRecord_t)) ;	// full resync
+	}
+	store.data()[Layout::bitmapAddr] ^= 0x04 ;						// slot 2 looks free
+	{
+		CardDBT<Store, Capacity, JournalSize> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbRepaired) ;
+		CHECK_EQ(db.writeCard(cardKey(40)), 1) ;					// deleted slot, not 2
+		CHECK_EQ(db.writeCard(cardKey(41)), 12) ;
+		CHECK_EQ(db.readCard(cardKey(2)), 2) ;
+		db.setCardTypeIdx(5, CardDBBase::masterCard) ;				// pending (journal) or written
+	}
+	store.data()[Layout::recordsAddr + 5 * sizeof(CardDBBase::recordType_t)] ^= 0x55 ;	// corrupt record 5
+	{
+		CardDBT<Store, Capacity, JournalSize> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbRepaired) ;
+		CHECK_EQ(db.readCardTypeIdx(5), CardDBBase::noCard) ;
+		CHECK_EQ(db.readCard(cardKey(5)), Capacity) ;
+		CHECK_EQ(db.writeCard(cardKey(42)), 5) ;
+	}
+	{
+		CardDBT<Store, Capacity, JournalSize> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbValid) ;
+		CHECK_EQ(db.readCard(cardKey(42)), 5) ;
+	}
+}
+
+// 64 bit keys: keys that only differ above bit 31 are different cards
+template <uint16_t Capacity>
+void testWideKeys(){
+	typedef CardDBT<MemoryStorage<1>, Capacity, 0> Layout ;
+	static MemoryStorage<Layout::storageSize> store ;
+	CardDBT<MemoryStorage<Layout::storageSize>, Capacity, 0> db(store) ;
+	db.begin() ;
+	uint64_t key = 0x12345678ULL, tagged = 37ULL << 48 | key ;
+	CHECK_EQ(db.writeCard(key), 0) ;
+	CHECK_EQ(db.readCard(tagged), Capacity) ;
+	CHECK_EQ(db.writeCard(tagged), 1) ;
+	CHECK_EQ(db.readCard(key), 0) ;
+	CHECK_EQ(db.readCard(tagged), 1) ;
+	CHECK(db.readCardIdIdx(1) == tagged) ;
+	CHECK_EQ(db.readCard(tagged ^ 1ULL << 32), Capacity) ;
+}
+
+// the record CRC covers the type: a bit flip does not turn a deleted card into a master card
+void testTypeFlip(){
+	typedef CardDBT<MemoryStorage<1>, 16, 0> Layout ;
+	typedef MemoryStorage<Layout::storageSize> Store ;
+	static Store store ;
+	{
+		CardDBT<Store, 16, 0> db(store) ;
+		db.begin() ;
+		for (uint16_t i=0 ; i < 4 ; i++)
+			db.writeCard(cardKey(i)) ;
+		db.deleteCard(cardKey(2)) ;
+	}
+	store.data()[Layout::recordsAddr + 2 * sizeof(CardDBBase::recordType_t) + offsetof(CardDBBase::recordType_t, cardType)] ^= 0x02 ;	// delCard -> masterCard
+	{
+		CardDBT<Store, 16, 0> db(store) ;
+		CHECK_EQ(db.begin(), CardDBBase::dbRepaired) ;
+		CHECK_EQ(db.readCardTypeIdx(2), CardDBBase::noCard) ;
+		CHECK_EQ(db.readCardType(cardKey(2)), CardDBBase::noCard) ;
+	}
+}
+
+// imported records: protected indexes and master cards are skipped
+void testImport(){
+	typedef CardDBT<MemoryStorage<1>, 16, 0> Layout ;
+	static MemoryStorage<Layout::storageSize> store ;
+	CardDBT<MemoryStorage<Layout::storageSize>, 16, 0> db(store) ;
+	db.begin() ;
+	CardDBBase::syncRecord_t recs[] = {
+		{ 0, 111, CardDBBase::idCard, 0 },						// protected index
+		{ 3, 333, CardDBBase::masterCard, 0 },					// no master cards from the controller
+		{ 4, 444, CardDBBase::idCard, 1 },
+		{ 5, 555, CardDBBase::delCard, 0 } } ;
+	CHECK_EQ(db.importRecords((const uint8_t *)recs, sizeof(recs), 1), 2) ;
+	CHECK_EQ(db.readCardTypeIdx(0), CardDBBase::noCard) ;
+	CHECK_EQ(db.readCardTypeIdx(3), CardDBBase::noCard) ;
+	CHECK_EQ(db.readCard(333), 16) ;
+	CHECK_EQ(db.readCardTypeIdx(4), CardDBBase::idCard) ;
+	CHECK_EQ(db.readCardRuleIdx(4), 1) ;
+	CHECK_EQ(db.readCardTypeIdx(5), CardDBBase::delCard) ;
+}
+
+// a controller of another generation gets all records, also when its version is not ahead of the database
+void testGeneration(){
+	typedef CardDBT<MemoryStorage<1>, 16, 0> Layout ;
+	typedef MemoryStorage<Layout::storageSize> Store ;
+	static Store store ;
+	uint8_t buf[16 * sizeof(CardDBBase::syncRecord_t)] ;
+	uint16_t since, generation, cardIndex ;
+	{
+		CardDBT<Store, 16, 0> db(store) ;
+		db.begin() ;
+		CHECK(db.generation() != 0) ;
+		for (uint16_t i=0 ; i < 8 ; i++)
+			db.writeCard(cardKey(i)) ;
+		since = 2 ;												// controller synced after two cards
+		generation = db.generation() ;
+		cardIndex = 0 ;
+		CHECK_EQ(db.exportSince(since, generation, cardIndex, buf, sizeof(buf)), 6 * sizeof(CardDBBase::syncRecord_t)) ;
+		cardIndex = 0 ;
+		CHECK_EQ(db.exportSince(since, 0, cardIndex, buf, sizeof(buf)), 16 * sizeof(CardDBBase::syncRecord_t)) ;	// no generation
+		db.initDB() ;
+		CHECK(db.generation() != generation) ;
+		for (uint16_t i=0 ; i < 3 ; i++)
+			db.writeCard(cardKey(i + 20)) ;
+		cardIndex = 0 ;
+		CHECK_EQ(db.exportSince(since, generation, cardIndex, buf, sizeof(buf)), 16 * sizeof(CardDBBase::syncRecord_t)) ;	// reset seen
+		generation = db.generation() ;
+	}
+	{
+		CardDBT<Store, 16, 0> db(store) ;							// kept in the header
+		CHECK_EQ(db.begin(), CardDBBase::dbValid) ;
+		CHECK_EQ(db.generation(), generation) ;
+	}
+	store.data()[Layout::bitmapAddr] ^= 0x01 ;
+	{
+		CardDBT<Store, 16, 0> db(store) ;							// repaired bitmap: new generation
+		CHECK_EQ(db.begin(), CardDBBase::dbRepaired) ;
+		CHECK(db.generation() != generation) ;
+	}
+}
+
+int main(){
+	testDB<16, 8>() ;				// RAM copy
+	testDB<16, 0>() ;
+	testDB<200, 8>() ;				// Bloom filter and storage scans
+	testDB<200, 0>() ;
+	testVersionWrap() ;
+	testJournal() ;
+	testCorruption<16, 8>() ;
+	testCorruption<200, 8>() ;
+	testCorruption<200, 0>() ;
+	testTypeFlip() ;
+	testWideKeys<16>() ;
+	testWideKeys<200>() ;
+	testImport() ;
+	testGeneration() ;
+	return testResult("carddb_test") ;
+}
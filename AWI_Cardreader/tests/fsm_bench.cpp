@@ -0,0 +1,86 @@
+/*
+ Transition table dispatch of the card reader sketch (same states, superstates and rows) per state and event:
+	reads	flash reads per dispatch (pgm_read_* and memcpy_P calls)
+	bytes	flash bytes read per dispatch as on the node (9 byte rows, 2 byte pointers)
+	ns		host time per dispatch (relative numbers)
+*/
+
+#include "FiniteStateMachine.h"
+#include <chrono>
+
+#define DISPATCHES 100000
+#define ROW_BYTES 9											// sizeof(FTransition) on the node
+
+enum cardEvents_t : byte { evNone, evMaster, evCard, evDeleted, evUnknown } ;
+static const char *eventNames[] = {"-", "master", "card", "deleted", "unknown"} ;
+
+static bool pin, access ;
+static bool pinNeeded() { return access && pin ; }
+static bool accessOk() { return access ; }
+static void action() {}
+
+FState idleState(NULL, NULL, NULL) ;
+FState activeState(NULL, NULL, NULL, 2000UL, idleState) ;
+FState modeState(activeState, NULL, NULL, NULL) ;
+FState delayState(activeState, NULL, NULL, NULL) ;
+FState unlockState(activeState, NULL, NULL, NULL) ;
+FState includeState(modeState, NULL, NULL, NULL) ;
+FState deleteState(modeState, NULL, NULL, NULL) ;
+FState confirmState(modeState, NULL, NULL, NULL) ;
+FState browseState(NULL, NULL, NULL) ;
+FState pinState(NULL, NULL, NULL, 15000UL, idleState) ;
+FiniteStateMachine stateMachine(idleState) ;
+
+const FTransition cardTable[] PROGMEM = {
+	{&idleState,	evMaster,	pinNeeded,	action,		&pinState},
+	{&idleState,	evMaster,	NULL,		action,		&unlockState},
+	{&idleState,	evCard,		pinNeeded,	action,		&pinState},
+	{&idleState,	evCard,		accessOk,	action,		&unlockState},
+	{&idleState,	evCard,		NULL,		action,		&delayState},
+	{&idleState,	evDeleted,	NULL,		action,		&delayState},
+	{&idleState,	evUnknown,	NULL,		action,		&delayState},
+	{&unlockState,	evMaster,	NULL,		NULL,		&includeState},
+	{&includeState,	evMaster,	NULL,		NULL,		&deleteState},
+	{&includeState,	evCard,		NULL,		action,		&delayState},
+	{&includeState,	evDeleted,	NULL,		action,		&delayState},
+	{&includeState,	evUnknown,	NULL,		action,		&delayState},
+	{&deleteState,	evMaster,	NULL,		NULL,		&browseState},
+	{&deleteState,	evCard,		NULL,		action,		&confirmState},
+	{&deleteState,	evDeleted,	NULL,		action,		&confirmState},
+	{&deleteState,	evUnknown,	NULL,		action,		&confirmState},
+	{&confirmState,	evMaster,	NULL,		action,		&idleState},
+	{&browseState,	evMaster,	NULL,		NULL,		&idleState},
+} ;
+
+static const struct { FState *state ; const char *name ; uint8_t event ; } cases[] = {
+	{&idleState, "idle", evMaster}, {&idleState, "idle", evCard}, {&idleState, "idle", evUnknown},
+	{&unlockState, "unlock", evMaster}, {&unlockState, "unlock", evCard}, {&delayState, "delay", evCard},
+	{&includeState, "include", evUnknown}, {&deleteState, "delete", evCard}, {&confirmState, "confirm", evMaster},
+	{&confirmState, "confirm", evCard}, {&browseState, "browse", evMaster}, {&pinState, "pin", evCard},
+} ;
+
+int main(){
+	access = true ;
+	printf("state    event     reads   bytes     ns\n") ;
+	unsigned long totalReads = 0, totalBytes = 0 ;
+	for (uint8_t c=0 ; c < sizeof(cases) / sizeof(cases[0]) ; c++){
+		stateMachine.immediateTransitionTo(*cases[c].state) ;
+		shimFlashReads = shimFlashBytes = shimFlashCopies = 0 ;
+		stateMachine.dispatch(cases[c].event, cardTable) ;
+		unsigned long bytes = shimFlashBytes - shimFlashCopies * (sizeof(FTransition) - ROW_BYTES) ;
+		unsigned long reads = shimFlashReads ;
+		totalReads += reads ;
+		totalBytes += bytes ;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now() ;
+		for (uint32_t i=0 ; i < DISPATCHES ; i++){
+			stateMachine.transitionTo(*cases[c].state) ;		// the row's next state is not entered
+			stateMachine.dispatch(cases[c].event, cardTable) ;
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() ;
+		printf("%-8s %-8s %6lu %7lu %6.1f\n", cases[c].name, eventNames[cases[c].event], reads, bytes,
+			ns / DISPATCHES) ;
+	}
+	printf("mean              %6.1f %7.1f\n", (double)totalReads / (sizeof(cases) / sizeof(cases[0])),
+		(double)totalBytes / (sizeof(cases) / sizeof(cases[0]))) ;
+	return 0 ;
+}
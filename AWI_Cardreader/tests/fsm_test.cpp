@@ -0,0 +1,78 @@
+/*
+ FiniteStateMachine: transition table dispatch (first matching row, guards, superstates, rows for any state),
+ entries and dwell times of states and superstates, time in the current state
+*/
+
+#include "FiniteStateMachine.h"
+#include "test.h"
+
+enum events_t : byte { evNone, evA, evB, evC } ;
+
+static bool allow ;
+static uint8_t actions ;
+static bool guard() { return allow ; }
+static void action() { actions++ ; }
+
+FState idle(NULL, NULL, NULL) ;
+FState active(NULL, NULL, NULL, 1000UL, idle) ;
+FState work(active, NULL, NULL, NULL) ;
+FState done(NULL, NULL, NULL) ;
+FiniteStateMachine fsm(idle) ;
+
+const FTransition table[] PROGMEM = {
+	{&idle,		evA,	guard,	action,	&done},
+	{&idle,		evA,	NULL,	NULL,	&work},
+	{&work,		evB,	NULL,	action,	&done},
+	{&active,	evA,	NULL,	NULL,	&idle},				// superstate handles evA for work
+	{0,			evC,	NULL,	action,	0},					// any state, stays
+} ;
+
+// dispatch: event in state, returns the next state
+static FState &dispatch(FState &state, uint8_t event){
+	fsm.immediateTransitionTo(state) ;
+	fsm.dispatch(event, table) ;
+	fsm.update() ;
+	return fsm.getCurrentState() ;
+}
+
+int main(){
+	fsm.update() ;
+	allow = true ;
+	CHECK(&dispatch(idle, evA) == &done) ;						// first matching row
+	CHECK_EQ(actions, 1) ;
+	allow = false ;
+	CHECK(&dispatch(idle, evA) == &work) ;						// guard fails, next row
+	CHECK_EQ(actions, 1) ;
+	CHECK(&dispatch(work, evB) == &done) ;
+	CHECK(&dispatch(work, evA) == &idle) ;						// row of the superstate
+	CHECK(&dispatch(work, evC) == &work) ;						// row for any state, no transition
+	CHECK_EQ(actions, 3) ;
+	CHECK(&dispatch(done, evB) == &done) ;						// not handled
+	shimFlashReads = 0 ;
+	fsm.dispatch(evNone, table) ;								// no event, no table read
+	CHECK_EQ(shimFlashReads, 0) ;
+	FState *states[] = {&idle, &active, &work, &done} ;
+	for (uint8_t i=0 ; i < 4 ; i++)
+		states[i]->clearStats() ;
+	fsm.immediateTransitionTo(idle) ;
+	shimAdvance(50000) ;
+	fsm.immediateTransitionTo(work) ;							// enters active and work
+	shimAdvance(100000) ;
+	fsm.immediateTransitionTo(done) ;							// leaves both
+	shimAdvance(30000) ;
+	fsm.immediateTransitionTo(idle) ;
+	CHECK_EQ(idle.getEntries(), 2) ;
+	CHECK_EQ(active.getEntries(), 1) ;
+	CHECK_EQ(work.getEntries(), 1) ;
+	CHECK_EQ(idle.getDwell(), 50) ;
+	CHECK_EQ(work.getDwell(), 100) ;
+	CHECK_EQ(active.getDwell(), 100) ;							// time in its substates
+	CHECK_EQ(done.getDwell(), 30) ;
+	shimAdvance(40000) ;
+	fsm.transitionTo(done) ;									// time in the state restarts with the request,
+	CHECK_EQ(fsm.timeInCurrentState(), 0) ;						// the dwell time with the transition
+	shimAdvance(10000) ;
+	fsm.update() ;
+	CHECK_EQ(idle.getDwell(), 100) ;
+	return testResult("fsm_test") ;
+}
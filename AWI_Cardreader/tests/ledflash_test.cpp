@@ -0,0 +1,82 @@
+/*
+ LedFlash on the fake clock, updated through a LedFlashGroup as from the timer interrupt (no timerWheel.update()):
+ on/ flash durations across the millis() wrap, counted flashes, pattern step timing and a fade down, PWM
+ connected and ended by the setters
+*/
+
+#include "LedFlash.h"
+#include "test.h"
+
+static LedFlash led(13, false), beep(12) ;				// pin = activeHigh ^ state: led on is a high pin, beep on a low pin
+static LedFlashGroup group ;
+
+// run: ms on the fake clock, the group updated every ms, returns the ms the led was on
+static unsigned long run(unsigned long ms){
+	unsigned long on = 0 ;
+	while (ms--){
+		shimAdvance(1000) ;
+		group.update() ;
+		on += shimPin[13] ;
+	}
+	return on ;
+}
+
+void testDurations(){
+	shimSetClock(0xFFFFFFFFUL - 500) ;								// on runs out after the wrap
+	led.on(2) ;
+	CHECK_EQ(run(1999), 1999) ;
+	run(2) ;
+	CHECK_EQ(shimPin[13], LOW) ;
+	beep.flash(1) ;
+	run(1) ;
+	CHECK_EQ(shimPin[12], LOW) ;
+	run(1100) ;
+	CHECK_EQ(shimPin[12], HIGH) ;
+	led.period(100, 50) ;
+	led.count(3) ;
+	unsigned long on = run(1000) ;									// 3 flashes of 50ms (pulse ends after > 50ms)
+	CHECK(on >= 150 && on <= 153) ;
+}
+
+void testPattern(){
+	led.play(ledDoubleBlink, 2) ;
+	unsigned long on = run(800) ;									// 100 on, 100 off, 100 on, 500 off
+	CHECK(on >= 199 && on <= 201) ;
+	on = run(800) ;
+	CHECK(on >= 199 && on <= 201) ;
+	CHECK_EQ(run(500), 0) ;											// played twice
+}
+
+void testFade(){
+	uint16_t writes = shimAnalogWrites ;
+	led.fade(255, 100) ;
+	CHECK_EQ(shimAnalogWrites, writes + 1) ;						// PWM connected by the setter
+	run(101) ;
+	CHECK_EQ(shimPin[13], 255) ;
+	led.fade(0, 255) ;												// negative step
+	uint8_t duty = 255 ;
+	bool down = true ;
+	for (int i = 0 ; i < 254 ; i++){
+		run(1) ;
+		down = down && shimPin[13] <= duty ;
+		duty = shimPin[13] ;
+	}
+	CHECK(down) ;
+	CHECK(duty < 255) ;
+	run(2) ;
+	CHECK_EQ(shimPin[13], LOW) ;									// faded out: off, still PWM
+	led.on() ;														// back to digital
+	writes = shimAnalogWrites ;
+	CHECK_EQ(run(10), 10) ;
+	CHECK_EQ(shimAnalogWrites, writes) ;
+	led.off() ;
+}
+
+int main(){
+	group.add(led) ;
+	group.add(beep) ;
+	testDurations() ;
+	testPattern() ;
+	testFade() ;
+	return testResult("ledflash_test") ;
+}
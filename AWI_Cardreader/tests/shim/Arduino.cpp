@@ -0,0 +1,69 @@
+/*
+ Host shim of the Arduino core for the tests
+*/
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+HardwareSerial Serial ;
+EEPROMClass EEPROM ;
+volatile uint8_t PORTB, PORTC, PORTD ;
+volatile uint8_t SREG = SREG_I ;					// interrupts enabled, like after init()
+uint8_t shimPin[SHIM_PINS] ;
+uint16_t shimAnalogWrites ;
+void (*shimIsr[2])() ;
+unsigned long shimFlashReads, shimFlashBytes, shimFlashCopies ;
+
+static unsigned long clockMillis, clockMicros, clockFraction ;	// fraction: us not yet in millis()
+
+unsigned long millis() { return clockMillis ; }
+unsigned long micros() { return clockMicros ; }
+
+void shimAdvance(unsigned long us){
+	clockMicros += us ;
+	clockFraction += us ;
+	clockMillis += clockFraction / 1000 ;
+	clockFraction %= 1000 ;
+}
+
+void shimSetClock(unsigned long ms){
+	clockMillis = ms ;
+	clockMicros = ms * 1000UL ;
+	clockFraction = 0 ;
+}
+
+void delay(unsigned long ms) { shimAdvance(ms * 1000UL) ; }
+void delayMicroseconds(unsigned int us) { shimAdvance(us) ; }
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t pin, uint8_t value) { if (pin < SHIM_PINS) shimPin[pin] = value ; }
+int digitalRead(uint8_t pin) { return pin < SHIM_PINS ? shimPin[pin] : LOW ; }
+void analogWrite(uint8_t pin, int value) { shimAnalogWrites++ ; if (pin < SHIM_PINS) shimPin[pin] = value ; }
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int) { if (interrupt < 2) shimIsr[interrupt] = isr ; }
+void detachInterrupt(uint8_t interrupt) { if (interrupt < 2) shimIsr[interrupt] = 0 ; }
+
+long random(long howsmall, long howbig) { return howsmall + rand() % (howbig - howsmall) ; }
+
+size_t Print::print(const char *s){
+	size_t n = 0 ;
+	while (*s) n += write(*s++) ;
+	return n ;
+}
+
+size_t Print::print(unsigned long n, int base){
+	char buf[8 * sizeof(long) + 1], *p = buf + sizeof(buf) - 1 ;
+	*p = 0 ;
+	do {
+		uint8_t digit = n % base ;
+		*--p = digit < 10 ? '0' + digit : 'A' + digit - 10 ;
+		n /= base ;
+	} while (n) ;
+	return print(p) ;
+}
+
+size_t Print::print(long n, int base){
+	if (n < 0 && base == DEC)
+		return write('-') + print((unsigned long)-n, base) ;
+	return print((unsigned long)n, base) ;
+}
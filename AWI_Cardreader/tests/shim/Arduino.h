@@ -0,0 +1,103 @@
+/*
+ Host shim of the Arduino core for the tests: fake clock, pins, interrupts and Serial on stdout.
+ Only what the Cardreader libraries use.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef uint8_t byte ;
+typedef bool boolean ;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define FALLING 2
+#define DEC 10
+#define HEX 16
+
+// program memory is plain memory on the host, flash reads are counted: pgm_read_* as on the node (2 byte
+// pointers), memcpy_P also as copies (their bytes are host sizes)
+#define PROGMEM
+#define F(s) s
+extern unsigned long shimFlashReads, shimFlashBytes, shimFlashCopies ;
+#define pgm_read_byte(a) (shimFlashReads++, shimFlashBytes += 1, *(const uint8_t *)(a))
+#define pgm_read_word(a) (shimFlashReads++, shimFlashBytes += 2, *(const uint16_t *)(a))
+#define pgm_read_dword(a) (shimFlashReads++, shimFlashBytes += 4, *(const uint32_t *)(a))
+#define pgm_read_ptr(a) (shimFlashReads++, shimFlashBytes += 2, *(void * const *)(a))
+#define memcpy_P(d, s, n) (shimFlashReads++, shimFlashCopies++, shimFlashBytes += (n), memcpy(d, s, n))
+
+// fake clock: only moves with shimAdvance(), delay() and delayMicroseconds()
+unsigned long millis() ;
+unsigned long micros() ;
+void shimAdvance(unsigned long us) ;				// moves micros() and millis() forward
+void shimSetClock(unsigned long ms) ;				// millis() = ms, micros() = ms * 1000 (wrap tests)
+void delay(unsigned long ms) ;
+void delayMicroseconds(unsigned int us) ;
+
+// pins: the last written value per pin, ports B/C/D as on an ATmega328p
+#define SHIM_PINS 20
+extern uint8_t shimPin[SHIM_PINS] ;					// digitalWrite value, analogWrite duty
+extern uint16_t shimAnalogWrites ;					// analogWrite calls
+void pinMode(uint8_t pin, uint8_t mode) ;
+void digitalWrite(uint8_t pin, uint8_t value) ;
+int digitalRead(uint8_t pin) ;
+void analogWrite(uint8_t pin, int value) ;
+extern volatile uint8_t PORTB, PORTC, PORTD ;
+#define NOT_A_PORT 0
+#define digitalPinToPort(p) ((p) < 8 ? 4 : (p) < 14 ? 2 : 3)
+#define digitalPinToBitMask(p) ((uint8_t)(1 << ((p) < 8 ? (p) : (p) < 14 ? (p) - 8 : (p) - 14)))
+#define portOutputRegister(P) ((P) == 2 ? &PORTB : (P) == 3 ? &PORTC : &PORTD)
+#define NOT_ON_TIMER 0
+#define digitalPinToTimer(p) ((p) == 3 || (p) == 5 || (p) == 6 || (p) == 9 || (p) == 10 || (p) == 11 ? 1 : NOT_ON_TIMER)
+
+// interrupts: SREG bit 7 is the global interrupt flag, attachInterrupt keeps the handler for the test
+#define SREG_I 0x80
+extern volatile uint8_t SREG ;
+#define cli() (SREG &= ~SREG_I)
+#define sei() (SREG |= SREG_I)
+#define noInterrupts() cli()
+#define interrupts() sei()
+#define ISR(vector) extern "C" void vector()
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : (p) == 3 ? 1 : -1)
+extern void (*shimIsr[2])() ;
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode) ;
+void detachInterrupt(uint8_t interrupt) ;
+
+long random(long howsmall, long howbig) ;
+
+// Print: the print/ println subset the libraries use, Serial writes to stdout
+class Print
+{
+public:
+	virtual size_t write(uint8_t c) = 0 ;
+	size_t print(const char *s) ;
+	size_t print(char c) { return write(c) ; } ;
+	size_t print(unsigned long n, int base = DEC) ;
+	size_t print(long n, int base = DEC) ;
+	size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base) ; } ;
+	size_t print(int n, int base = DEC) { return print((long)n, base) ; } ;
+	size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base) ; } ;
+	template <class T> size_t println(T value, int base = DEC) { return print(value, base) + println() ; } ;
+	size_t println(const char *s) { return print(s) + println() ; } ;
+	size_t println() { return write('\n') ; } ;
+};
+
+class HardwareSerial : public Print
+{
+public:
+	void begin(unsigned long) {} ;
+	int available() { return 0 ; } ;
+	int read() { return -1 ; } ;
+	size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1 ; } ;
+};
+
+extern HardwareSerial Serial ;
+#endif
@@ -0,0 +1,25 @@
+/*
+ Host shim of the Arduino EEPROM library: 1 KB like an ATmega328p, starts erased (0xFF)
+*/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+#define SHIM_EEPROM 1024
+
+class EEPROMClass
+{
+public:
+	EEPROMClass() { memset(_mem, 0xFF, sizeof(_mem)) ; } ;
+	uint8_t read(int addr) { return _mem[addr] ; } ;
+	void write(int addr, uint8_t value) { _mem[addr] = value ; } ;
+	void update(int addr, uint8_t value) { if (_mem[addr] != value) _mem[addr] = value ; } ;
+	uint16_t length() { return SHIM_EEPROM ; } ;
+private:
+	uint8_t _mem[SHIM_EEPROM] ;
+};
+
+extern EEPROMClass EEPROM ;
+#endif
@@ -0,0 +1,20 @@
+/*
+ Minimal check macros for the host tests: failed checks are printed, main returns the failure count
+*/
+
+#ifndef test_h
+#define test_h
+
+#include <stdio.h>
+
+static int testFailures ;
+
+#define CHECK(cond) do { if (!(cond)){ printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond) ; testFailures++ ; } } while (0)
+#define CHECK_EQ(a, b) do { long long _a = (a), _b = (b) ; if (_a != _b){ printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, _a, _b) ; testFailures++ ; } } while (0)
+
+// testResult: summary line, exit code for make
+static inline int testResult(const char *name){
+	printf("%s: %s (%d failed)\n", name, testFailures ? "FAIL" : "ok", testFailures) ;
+	return testFailures ? 1 : 0 ;
+}
+#endif
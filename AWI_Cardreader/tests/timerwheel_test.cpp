@@ -0,0 +1,96 @@
+/*
+ TimerWheel on the fake clock: one shot and periodic timers, expired(), remaining() and nextDeadline(), timers
+ stopped and started from the callback of another timer that runs out in the same update, millis() wrap
+*/
+
+#include "TimerWheel.h"
+#include "test.h"
+
+static uint8_t fired[4] ;
+static WheelTimer *other ;					// timer the callback acts on
+static uint8_t otherAction ;				// 1 stop, 2 start, 3 stop and start
+static void count(void *arg) { fired[(intptr_t)arg]++ ; }
+static void act(void *arg){
+	count(arg) ;
+	if (otherAction & 1) other->stop() ;
+	if (otherAction & 2) other->start(100) ;
+}
+
+// run: ms on the fake clock, timerWheel.update() every ms
+static void run(unsigned long ms){
+	while (ms--){
+		shimAdvance(1000) ;
+		timerWheel.update() ;
+	}
+}
+
+void testBasics(){
+	WheelTimer once(count, (void *)0), periodic(count, (void *)1), flag ;
+	once.start(50) ;
+	periodic.start(20, 20) ;
+	flag.start(30) ;
+	CHECK(once.active() && periodic.active()) ;
+	CHECK(timerWheel.nextDeadline() <= 20 + (1 << TIMERWHEEL_SHIFT)) ;
+	run(49) ;
+	CHECK_EQ(fired[0], 0) ;
+	run(1 << TIMERWHEEL_SHIFT) ;									// runs out within one slot
+	CHECK_EQ(fired[0], 1) ;
+	CHECK(!once.active()) ;
+	CHECK(flag.expired()) ;
+	CHECK(!flag.expired()) ;										// once
+	run(1000 - 49 - (1 << TIMERWHEEL_SHIFT)) ;
+	CHECK(fired[1] >= 49 && fired[1] <= 50) ;						// periodic in phase
+	periodic.stop() ;
+	CHECK_EQ(periodic.remaining(), TIMERWHEEL_NONE) ;
+	CHECK_EQ(timerWheel.nextDeadline(), TIMERWHEEL_NONE) ;
+	memset(fired, 0, sizeof(fired)) ;
+}
+
+// a and b run out in the same update, a's callback stops/ starts b before b fires
+void testCallbacks(){
+	static const uint8_t actions[] = {1, 2, 3} ;
+	for (uint8_t i=0 ; i < sizeof(actions) ; i++){
+		WheelTimer a(act, (void *)0), b(count, (void *)1), c(count, (void *)2) ;
+		other = &b ;
+		otherAction = actions[i] ;
+		a.start(10) ;												// due in start order: a, b, c
+		b.start(10) ;
+		c.start(10) ;												// a due timer behind b
+		run(10 + (1 << TIMERWHEEL_SHIFT)) ;
+		CHECK_EQ(fired[0], 1) ;
+		CHECK_EQ(fired[2], 1) ;										// the due list is intact
+		if (otherAction & 2){										// started again: fires 100ms later
+			CHECK_EQ(fired[1], 0) ;
+			CHECK(b.active()) ;
+			run(100 + (1 << TIMERWHEEL_SHIFT)) ;
+			CHECK_EQ(fired[1], 1) ;
+		} else {													// stopped: never fires
+			CHECK(!b.active()) ;
+			run(200) ;
+			CHECK_EQ(fired[1], 0) ;
+		}
+		CHECK_EQ(fired[2], 1) ;
+		CHECK_EQ(timerWheel.nextDeadline(), TIMERWHEEL_NONE) ;
+		memset(fired, 0, sizeof(fired)) ;
+	}
+}
+
+// deadlines across the millis() wrap
+void testWrap(){
+	shimSetClock(0xFFFFFFFFUL - 100) ;
+	timerWheel.update() ;
+	WheelTimer t(count, (void *)3) ;
+	t.start(200) ;
+	run(150) ;
+	CHECK_EQ(fired[3], 0) ;
+	CHECK(t.remaining() <= 50 + (1 << TIMERWHEEL_SHIFT)) ;
+	run(50 + (1 << TIMERWHEEL_SHIFT)) ;
+	CHECK_EQ(fired[3], 1) ;
+}
+
+int main(){
+	testBasics() ;
+	testCallbacks() ;
+	testWrap() ;
+	return testResult("timerwheel_test") ;
+}
@@ -0,0 +1,120 @@
+/*
+ Wiegand decoder throughput and frame rate on the fake clock:
+	decode	host time per bit (D0/ D1 interrupt, fake clock step included) and per frame completion (timer tick),
+			by frame length (relative numbers, to compare decoder changes)
+	gap		shortest quiet time between frames that still decodes every frame (shorter gaps merge frames)
+	rate	highest frame rate per bit period: frame time + shortest gap
+	loop	frames dropped when the loop takes the events only every n ms, frames at the highest rate
+*/
+
+#include "Wiegand.h"
+#include <chrono>
+
+#define FRAMES 20000
+
+static const struct { uint8_t bits ; uint64_t frame ; } frames[] = {
+	{4, 0x5}, {8, 0xE1}, {26, 0x2A5E54FULL}, {34, 0x4D3CCA26ULL}, {35, 0x34D418B8FULL}, {37, 0x128BD23F0ULL},
+	{48, 0xE24BE41818E9ULL},
+} ;
+
+static double nanos(std::chrono::steady_clock::time_point start){
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() ;
+}
+
+static WIEGAND w ;													// reader on pins 2/ 3, begin() in main
+
+// feed: one frame, period us per bit, the first bit gap us after the last one
+static void feed(uint8_t bits, uint64_t data, unsigned long gap, unsigned long period){
+	shimAdvance(gap - period) ;
+	for (int8_t b = bits - 1 ; b >= 0 ; b--){
+		shimAdvance(period) ;
+		shimIsr[(data >> b) & 1]() ;
+	}
+}
+
+// decoded: frames decoded back to back at gap us (loop takes the events every frame)
+static uint16_t decoded(uint8_t f, unsigned long gap, unsigned long period){
+	uint16_t n = 0 ;
+	for (uint16_t i=0 ; i < 200 ; i++){
+		feed(frames[f].bits, frames[f].frame, gap, period) ;
+		while (w.available())
+			n++ ;
+	}
+	shimAdvance(26000) ;
+	WIEGAND::Tick() ;
+	while (w.available())
+		n++ ;
+	return n ;
+}
+
+int main(){
+	w.begin() ;
+	printf("decode: host ns per bit, per frame completion\n") ;
+	printf(" bits    bit  frame\n") ;
+	for (uint8_t f=0 ; f < sizeof(frames) / sizeof(frames[0]) ; f++){
+		double bit = 0, complete = 0 ;
+		for (uint16_t i=0 ; i < FRAMES ; i++){
+			shimAdvance(30000) ;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now() ;
+			for (int8_t b = frames[f].bits - 1 ; b >= 0 ; b--){
+				shimAdvance(2000) ;
+				shimIsr[(frames[f].frame >> b) & 1]() ;
+			}
+			bit += nanos(start) ;
+			shimAdvance(30000) ;
+			start = std::chrono::steady_clock::now() ;
+			WIEGAND::Tick() ;
+			complete += nanos(start) ;
+			w.available() ;
+		}
+		printf(" %4u %6.1f %6.1f\n", frames[f].bits, bit / FRAMES / frames[f].bits, complete / FRAMES) ;
+	}
+
+	printf("\ngap: shortest quiet time between frames that decodes every frame (us)\n") ;
+	unsigned long shortest = 0 ;
+	for (unsigned long gap = 20000 ; gap <= 30000 && !shortest ; gap += 100){
+		shortest = gap ;
+		for (uint8_t f=0 ; f < sizeof(frames) / sizeof(frames[0]) ; f++){
+			if (decoded(f, gap, 2000) != 200)
+				shortest = 0 ;
+		}
+	}
+	printf(" %lu\n", shortest) ;
+
+	printf("\nrate: highest frame rate (frames/s) by bit period\n") ;
+	static const unsigned long periods[] = {100, 500, 1000, 2000} ;
+	printf(" bits") ;
+	for (uint8_t p=0 ; p < 4 ; p++)
+		printf(" %6luus", periods[p]) ;
+	printf("\n") ;
+	for (uint8_t f=0 ; f < sizeof(frames) / sizeof(frames[0]) ; f++){
+		printf(" %4u", frames[f].bits) ;
+		for (uint8_t p=0 ; p < 4 ; p++){
+			unsigned long frameTime = (frames[f].bits - 1) * periods[p] + shortest ;
+			bool ok = decoded(f, shortest, periods[p]) == 200 ;
+			printf(" %7.1f%s", 1e6 / frameTime, ok ? " " : "!") ;		// ! = frames lost
+		}
+		printf("\n") ;
+	}
+
+	printf("\nloop: 26 bit frames (2ms bits) dropped by the loop period, queue of %u\n", WIEGAND_QUEUE) ;
+	printf(" loop ms  dropped\n") ;
+	for (unsigned long loop = 50 ; loop <= 800 ; loop *= 2){
+		unsigned long next = millis() + loop ;
+		uint16_t n = 0 ;
+		for (uint16_t i=0 ; i < 200 ; i++){
+			feed(26, frames[2].frame, shortest, 2000) ;
+			if ((long)(millis() - next) >= 0){
+				while (w.available())
+					n++ ;
+				next += loop ;
+			}
+		}
+		shimAdvance(26000) ;
+		WIEGAND::Tick() ;
+		while (w.available())
+			n++ ;
+		printf(" %7lu  %5.1f%%\n", loop, (200 - n) / 2.0) ;
+	}
+	return 0 ;
+}
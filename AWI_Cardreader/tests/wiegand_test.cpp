@@ -0,0 +1,215 @@
+/*
+ Wiegand decoder fed through the interrupt handlers of a reader on the fake clock: all card formats and keys, bit
+ jitter, parity errors, truncated frames, noise, back to back frames, queue overflow and the statistics
+*/
+
+#include "Wiegand.h"
+#include "test.h"
+
+// the formats as in their descriptions (bit 1 = first bit received), independent of the decoder's masks:
+// each parity bit covers the bits from..to, except those with position % 3 == skip (3 = none), in this order
+struct check_t {
+	uint8_t bit, from, to, skip ;
+	bool odd ;
+} ;
+struct encoding_t {
+	uint8_t bits ;
+	uint8_t facility[2], card[2] ;
+	check_t checks[3] ;							// bit 0 = unused
+} ;
+static const encoding_t encodings[] = {
+	{26, {2, 9}, {10, 25}, {{1, 2, 13, 3, false}, {26, 14, 25, 3, true}}},						// H10301
+	{34, {2, 17}, {18, 33}, {{1, 2, 17, 3, false}, {34, 18, 33, 3, true}}},
+	{35, {3, 14}, {15, 34}, {{2, 3, 34, 2, false}, {35, 2, 33, 1, true}, {1, 2, 35, 3, true}}},	// Corporate 1000 35
+	{37, {2, 17}, {18, 36}, {{1, 2, 19, 3, false}, {37, 19, 36, 3, true}}},						// H10304
+	{48, {3, 24}, {25, 47}, {{2, 3, 46, 2, false}, {48, 2, 47, 1, true}, {1, 2, 48, 3, true}}},	// Corporate 1000 48
+} ;
+static const uint8_t formats = sizeof(encodings) / sizeof(encodings[0]) ;
+
+// encode: frame with the parity bits set for facility and card, code is what the decoder returns
+static uint64_t encode(const encoding_t &e, uint64_t facility, uint64_t card, uint64_t &code){
+	uint8_t facilityLen = e.facility[1] - e.facility[0] + 1, cardLen = e.card[1] - e.card[0] + 1 ;
+	facility &= ((uint64_t)1 << facilityLen) - 1 ;
+	card &= ((uint64_t)1 << cardLen) - 1 ;
+	uint64_t frame = facility << (e.bits - e.facility[1]) | card << (e.bits - e.card[1]) ;
+	for (uint8_t i=0 ; i < 3 && e.checks[i].bit ; i++){
+		const check_t &c = e.checks[i] ;
+		uint8_t ones = 0 ;
+		for (uint8_t pos = c.from ; pos <= c.to ; pos++){
+			if (pos % 3 != c.skip)
+				ones ^= (frame >> (e.bits - pos)) & 1 ;
+		}
+		frame |= (uint64_t)(ones ^ c.odd) << (e.bits - c.bit) ;		// even: parity bit = ones, odd: inverted
+	}
+	code = facility << cardLen | card ;
+	return frame ;
+}
+
+static uint64_t random64() { return (uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ rand() ; }
+
+static WIEGAND w ;													// reader on pins 2/ 3, begin() in main
+
+// frame: feeds the bits (first bit received first) through the D0/ D1 interrupts period us apart +/- jitter on the
+// fake clock, the first bit gap us after the last one
+static void frame(uint8_t bits, uint64_t data, unsigned long gap = 26000, unsigned long period = 2000,
+		long jitter = 0){
+	shimAdvance(gap - period) ;
+	for (int8_t b = bits - 1 ; b >= 0 ; b--){
+		shimAdvance(period + (jitter ? random(-jitter, jitter + 1) : 0)) ;
+		shimIsr[(data >> b) & 1]() ;
+	}
+}
+
+// idle: the line is quiet for ms after the last bit, the timer tick completes the frame
+static void idle(unsigned long ms = 26){
+	shimAdvance(ms * 1000) ;
+	WIEGAND::Tick() ;
+}
+
+// fresh: completes what a test left on the line, empties the queue and clears the counters
+static void fresh(){
+	idle() ;
+	while (w.available())
+		;
+	w.clearStats() ;
+}
+
+// event: next decoded event equals code and bit length
+static bool event(uint64_t code, int bits){
+	return w.available() && w.getCode() == code && w.getWiegandType() == bits ;
+}
+
+// known frames (from real cards and keypads)
+void testVectors(){
+	static const struct { uint8_t bits ; uint64_t frame, code ; } vectors[] = {
+		{26, 0x2A5E54FULL, 0x52F2A7ULL},							// H10301
+		{34, 0x4D3CCA26ULL, 0x269E6513ULL},
+		{35, 0x34D418B8FULL, 0xA6A0C5C7ULL},						// Corporate 1000 35
+		{37, 0x128BD23F0ULL, 0x945E91F8ULL},						// H10304
+		{48, 0xE24BE41818E9ULL, 0x1125F20C0C74ULL},					// Corporate 1000 48
+		{8, 0xE1, 1},												// key 1
+		{8, 0x4B, WIEGAND_ENTER},									// key *
+		{8, 0x5A, WIEGAND_ESCAPE},									// key #
+		{4, 0x5, 5},												// key 5 (4 bit)
+		{4, 0xB, WIEGAND_ENTER},
+	} ;
+	fresh() ;
+	for (uint8_t i=0 ; i < sizeof(vectors) / sizeof(vectors[0]) ; i++){
+		frame(vectors[i].bits, vectors[i].frame) ;
+		unsigned long last = millis() ;
+		idle() ;
+		CHECK(event(vectors[i].code, vectors[i].bits)) ;
+		CHECK_EQ(w.getTime(), last) ;								// time of the last bit
+		CHECK(!w.available()) ;
+	}
+	for (uint8_t i=0 ; i < formats ; i++){							// the encoder agrees with the vectors
+		uint64_t code, v = vectors[i].code ;
+		uint8_t cardLen = encodings[i].card[1] - encodings[i].card[0] + 1 ;
+		CHECK_EQ(encode(encodings[i], v >> cardLen, v, code), vectors[i].frame) ;
+	}
+}
+
+// random codes of all formats with +/- 0.9ms bit jitter, every single bit error is caught by the parity
+void testFormats(){
+	fresh() ;
+	for (uint16_t n=0 ; n < 500 ; n++){
+		const encoding_t &e = encodings[n % formats] ;
+		uint64_t code, data = encode(e, random64(), random64(), code) ;
+		frame(e.bits, data, 26000, 2000, 900) ;
+		idle() ;
+		CHECK(event(code, e.bits)) ;
+		frame(e.bits, data ^ (uint64_t)1 << (rand() % e.bits), 26000, 2000, 900) ;
+		idle() ;
+		CHECK(!w.available()) ;
+	}
+	wiegandStats_t stats ;
+	w.getStats(stats) ;
+	CHECK_EQ(stats.frames, 500) ;
+	CHECK_EQ(stats.parity, 500) ;
+	uint16_t gaps = 0 ;
+	for (uint8_t i=0 ; i < 8 ; i++)
+		gaps += stats.gaps[i] ;
+	CHECK_EQ(gaps, stats.edges[0] + stats.edges[1] - 1000) ;		// first bit of a frame has no gap
+	CHECK_EQ(stats.gaps[0] + stats.gaps[1] + stats.gaps[2] + stats.gaps[3] + stats.gaps[6] + stats.gaps[7], 0) ;	// 1.1..2.9ms
+}
+
+// truncated frames, noise and back to back frames (completed by the next bit, no quiet line in between)
+void testLine(){
+	fresh() ;
+	uint64_t code, data = encode(encodings[0], 0x52, 0xF2A7, code) ;
+	frame(25, data >> 1) ;									// truncated 26 bit
+	frame(47, 0x123456789ABCULL) ;							// truncated 48 bit
+	frame(3, 0x5) ;											// noise burst
+	frame(1, 1) ;
+	frame(26, data) ;
+	frame(26, data) ;											// back to back, no idle in between
+	frame(8, 0xE1) ;
+	shimAdvance(25000) ;											// not yet quiet for more than 25ms
+	WIEGAND::Tick() ;
+	CHECK(event(code, 26)) ;
+	CHECK(event(code, 26)) ;
+	CHECK(!w.available()) ;
+	shimAdvance(1000) ;
+	WIEGAND::Tick() ;
+	CHECK(event(1, 8)) ;
+	frame(26, data) ;
+	frame(26, data, 20000) ;										// 20ms gap: merged into one 52 bit frame
+	idle() ;
+	CHECK(!w.available()) ;
+	wiegandStats_t stats ;
+	w.getStats(stats) ;
+	CHECK_EQ(stats.rejects[0], 2) ;									// 3 and 1 bit
+	CHECK_EQ(stats.rejects[3], 1) ;									// 25 bit
+	CHECK_EQ(stats.rejects[5], 1) ;									// 47 bit
+	CHECK_EQ(stats.rejects[6], 1) ;									// 52 bit
+	CHECK_EQ(stats.frames, 3) ;
+	w.clearStats() ;
+	w.getStats(stats) ;
+	CHECK_EQ(stats.edges[0] + stats.edges[1], 0) ;
+}
+
+// events the loop did not take yet are queued, the queue holds WIEGAND_QUEUE - 1
+void testQueue(){
+	fresh() ;
+	for (uint8_t key=0 ; key < 6 ; key++)
+		frame(8, (~key & 0x0F) << 4 | key) ;
+	idle() ;
+	for (uint8_t key=0 ; key < WIEGAND_QUEUE - 1 ; key++)
+		CHECK(event(key, 8)) ;
+	CHECK(!w.available()) ;
+	wiegandStats_t stats ;
+	w.getStats(stats) ;
+	CHECK_EQ(stats.overflow, 6 - (WIEGAND_QUEUE - 1)) ;
+}
+
+// the frame completed by the timer tick 25ms after its last bit, reader slots
+void testTimer(){
+	fresh() ;
+	shimSetClock(1000) ;											// millis() 1002..1068 for the bits
+	uint64_t code, data = encode(encodings[1], 0x269E, 0x6513, code) ;
+	frame(34, data, 2000) ;
+	shimAdvance(20000) ;
+	WIEGAND::Tick() ;												// quiet for 20ms: still receiving
+	CHECK(!w.available()) ;
+	shimAdvance(6000) ;
+	WIEGAND::Tick() ;
+	CHECK(event(code, 34)) ;
+	CHECK_EQ(w.getTime(), 1068) ;
+	CHECK(w.begin()) ;												// same reader keeps its slot
+	WIEGAND more[WIEGAND_READERS] ;
+	for (uint8_t i=0 ; i < WIEGAND_READERS - 1 ; i++)
+		CHECK(more[i].begin()) ;
+	CHECK(!more[WIEGAND_READERS - 1].begin()) ;						// all slots in use
+}
+
+int main(){
+	srand(1) ;
+	CHECK(w.begin()) ;
+	CHECK(shimIsr[0] && shimIsr[1]) ;
+	testVectors() ;
+	testFormats() ;
+	testLine() ;
+	testQueue() ;
+	testTimer() ;
+	return testResult("wiegand_test") ;
+}